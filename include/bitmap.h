@@ -0,0 +1,67 @@
+/* SPDX-FileCopyrightText : (c) 2026 LG Electronics Inc. */
+/* SPDX-License-Identifier : GPL-2.0 */
+
+/* bitmap.h  -  Cluster bitmaps */
+
+#ifndef _BITMAP_H
+#define _BITMAP_H
+
+#include "common.h"
+
+/* Bitmap is split into chunks of BITMAP_CHUNK_BITS bits. In compressed
+ * bitmap, chunk of which bits are all clear or all set shares one of two
+ * static chunks and only mixed chunks are allocated. Flat bitmap has all
+ * chunks in one area and never changes them.
+ * FAT_BUF has multiple of BITMAP_CHUNK_BITS entries for all FAT types,
+ * so threads reading FAT never share a chunk. */
+#define BITMAP_CHUNK_BITS   8192
+#define BITMAP_CHUNK_WORDS  (BITMAP_CHUNK_BITS / BITS_PER_LONG)
+
+typedef struct bitmap {
+    unsigned int bits;
+    unsigned int nchunks;
+    unsigned long **chunk;
+    unsigned int *weight;   /* set bits of each chunk, NULL if flat */
+} BITMAP;
+
+/* Allocates bitmap of 'bits' clear bits, compressed if 'compress' is set */
+BITMAP *alloc_bitmap(unsigned int bits, int compress);
+void free_bitmap(BITMAP *bm);
+
+static inline int bitmap_test_bit(BITMAP *bm, unsigned int nr)
+{
+    unsigned long *p = bm->chunk[nr / BITMAP_CHUNK_BITS];
+
+    nr %= BITMAP_CHUNK_BITS;
+    return 1UL & (p[BIT_WORD(nr)] >> (nr % BITS_PER_LONG));
+}
+
+void bitmap_set_bit(BITMAP *bm, unsigned int nr);
+void bitmap_clear_bit(BITMAP *bm, unsigned int nr);
+
+/* Stores 'word' as 'index'-th word of bitmap */
+void bitmap_store_word(BITMAP *bm, unsigned int index, unsigned long word);
+
+/* Range versions, same as set_bits(), clear_bits(), count_bits(),
+ * find_next_bit() and find_next_zero_bit() */
+void bitmap_set_range(BITMAP *bm, unsigned int nr, unsigned int cnt);
+void bitmap_clear_range(BITMAP *bm, unsigned int nr, unsigned int cnt);
+unsigned int bitmap_count(BITMAP *bm, unsigned int nr, unsigned int cnt);
+unsigned int bitmap_find_next(BITMAP *bm, unsigned int nr, unsigned int end);
+unsigned int bitmap_find_next_zero(BITMAP *bm, unsigned int nr,
+        unsigned int end);
+
+/* Whole bitmap operations, both bitmaps should have same size */
+void bitmap_zero(BITMAP *bm);
+void bitmap_xor(BITMAP *dst, BITMAP *src);      /* dst ^= src */
+void bitmap_andnot(BITMAP *dst, BITMAP *src);   /* dst &= ~src */
+
+#define for_each_bitmap_set(bit, start, end, bm) \
+    for ((bit) = bitmap_find_next((bm), (start), (end)); (bit) < (end); \
+            (bit) = bitmap_find_next((bm), (bit) + 1, (end)))
+
+#define for_each_bitmap_clear(bit, start, end, bm) \
+    for ((bit) = bitmap_find_next_zero((bm), (start), (end)); (bit) < (end); \
+            (bit) = bitmap_find_next_zero((bm), (bit) + 1, (end)))
+
+#endif
@@ -9,6 +9,7 @@
 
 void read_boot(DOS_FS *fs);
 void clean_boot(DOS_FS *fs);
+void set_all_fats(int all);
 
 /* Reads the boot sector from the currently open device and initializes *FS */
 
@@ -11,6 +11,9 @@
 #define MAX_RECLAIMED_FILE  (9999)      /* about XXXX for FSCKXXXX.REC */
 #define MAX_RENAMED_FILE    (9999999)   /* about XXXXXXX for FSCKXXXX.XXX */
 
+#define OWNER_MAP_SIZE      0   /* 4 bytes per cluster, not used by default */
+#define CHAIN_TEST_SIZE     (1024 * 1024)   /* max bytes of one read test */
+
 /* Allocate a free slot in the root directory for a new file. The file name is
    constructed after 'pattern', which must include a %d type format for printf
    and expand to exactly 11 characters. The name actually used is written into
@@ -27,6 +30,11 @@ loff_t alloc_reclaimed_entry(DOS_FS *fs, DIR_ENT *de, const char *pattern);
    be checked again. */
 int scan_root(DOS_FS *fs);
 
+/* Sets the memory limit of the cluster owner map used by scan_root. If the
+   map of the file system doesn't fit, owners of shared clusters are searched
+   by walking the directory tree. */
+void set_owner_map_size(long long size);
+
 int check_volume_label(DOS_FS *fs);
 int check_valid_label(char *label);
 void scan_root_only(DOS_FS *fs, label_t **head, label_t **last);
@@ -60,17 +60,37 @@ void *alloc_mem(int size);
 void free_mem(void *p);
 void print_mem(void);
 
-/* Like alloc, but registers the data area in a list described by ROOT. */
-void *qalloc(void **root, int size);
-
-/* Deallocates all qalloc'ed data areas described by ROOT. */
-void qfree(void **root);
+#define ARENA_SLAB_SIZE (256 * 1024)
+#define ARENA_ALIGN     8   /* largest alignment of arena users */
+
+/* Arena hands out zeroed areas from slabs of ARENA_SLAB_SIZE bytes. Area
+   larger than a quarter of slab gets a slab of its own. */
+typedef struct arena {
+    struct arena_slab *head;    /* slabs kept over resets */
+    struct arena_slab *cur;     /* slab being allocated from */
+    struct arena_slab *big;     /* slabs of large areas */
+    unsigned long size;         /* bytes of all slabs */
+    unsigned long used;         /* bytes allocated since reset */
+    unsigned long max_used;
+} ARENA;
+
+/* Like alloc, but allocates the data area from ARENA. */
+void *qalloc(ARENA *arena, int size);
+
+/* Releases all qalloc'ed data areas of ARENA at once. Slabs are kept for
+   following qalloc calls, except those of large areas. */
+void qfree(ARENA *arena);
+void print_arena(ARENA *arena);
 
 /* Returns the smaller integer value of a and b. */
 int min(int a, int b);
 /* Returns the larger integer value of a and b. */
 int max(int a, int b);
 
+/* Parses STR as a size in bytes with an optional K, M or G suffix.
+   Returns -1 if STR is not a valid size. */
+long long parse_size(char *str);
+
 /* Displays PROMPT and waits for user input. Only characters in VALID are
    accepted. Terminates the program on EOF. Returns the character. */
 char get_key(char *valid, char *prompt);
@@ -82,6 +102,27 @@ void clear_bit(unsigned int nr, unsigned long *p);
 int test_bit(unsigned int nr, unsigned long *p);
 void change_bit(unsigned int nr, unsigned long *p);
 
+/* Range versions of above, which operate a word at a time */
+void set_bits(unsigned int nr, unsigned int cnt, unsigned long *p);
+void clear_bits(unsigned int nr, unsigned int cnt, unsigned long *p);
+unsigned int count_bits(unsigned int nr, unsigned int cnt, unsigned long *p);
+unsigned int find_next_bit(unsigned int nr, unsigned int end, unsigned long *p);
+unsigned int find_next_zero_bit(unsigned int nr, unsigned int end,
+        unsigned long *p);
+
+/* Word-wise operations over whole bitmaps of 'words' words */
+void xor_bitmap(unsigned long *dst, unsigned long *src, unsigned int words);
+void andnot_bitmap(unsigned long *dst, unsigned long *src, unsigned int words);
+
+/* Iterate 'bit' over set or clear bits of 'p' from 'start' before 'end' */
+#define for_each_set_bit(bit, start, end, p) \
+    for ((bit) = find_next_bit((start), (end), (p)); (bit) < (end); \
+            (bit) = find_next_bit((bit) + 1, (end), (p)))
+
+#define for_each_clear_bit(bit, start, end, p) \
+    for ((bit) = find_next_zero_bit((start), (end), (p)); (bit) < (end); \
+            (bit) = find_next_zero_bit((bit) + 1, (end), (p)))
+
 static inline int is_power_of_2(unsigned long n)
 {
     return (n != 0 && ((n & (n - 1)) == 0));
@@ -7,6 +7,8 @@
 #include <stdint.h>
 //#include <asm/types.h>
 
+#include "bitmap.h"
+
 #undef CF_LE_W
 #undef CF_LE_L
 #undef CT_LE_W
@@ -42,6 +44,9 @@
 #define MSDOS_FAT16_SIGN "FAT16   "	/* FAT16 filesystem signature */
 #define MSDOS_FAT32_SIGN "FAT32   "	/* FAT32 filesystem signature */
 
+#define FAT32_NO_MIRROR     (0x80)  /* flags: only active FAT is used */
+#define FAT32_ACTIVE_FAT    (0x0f)  /* flags: number of active FAT */
+
 #define BOOT_SIGN       (0xAA55)        /* trail signature */
 #define LEAD_SIGN       (0x41615252)    /* fsinfo lead signature('RRaA') */
 #define STRUCT_SIGN     (0x61417272)    /* fsinfo struct signature('rrAa') */
@@ -88,6 +93,7 @@ extern uint32_t max_clus_num;
 
 #define FAT_BUF         (96 * 1024) /* 96K, Common Multiple(CM) of 12,16,32 fat size */
 #define FAT_CACHE_BUF   (4096)      /* for mmap, aligned page size for FAT cache */
+#define FAT_PAGE_SIZE   (4096)      /* unit of writing changed FAT entries */
 #define FAT_CACHE_SIZE  (FAT_CACHE_BUF)
 
 /* __attribute__ ((packed)) is used on all structures to make gcc ignore any
@@ -168,28 +174,59 @@ struct dir_entry {
 
 typedef struct dir_entry DIR_ENT;
 
+/* Fields of directory entry which are kept for the whole check,
+ * same as in DIR_ENT. Others such as time stamps are read again from
+ * the device when needed. */
+typedef struct dos_ent {
+    __u8    name[LEN_FILE_NAME];
+    __u8    attr;
+    __u16   starthi;
+    __u16   start;
+    __u32   size;
+} __attribute__ ((packed)) DOS_ENT;
+
 typedef struct _dos_file {
-    DIR_ENT dir_ent;
-    char *lfn;
     loff_t offset;
+    char *lfn;
     struct _dos_file *parent; /* parent directory */
     struct _dos_file *next; /* next entry */
     struct _dos_file *first; /* first entry (directory only) */
+    DOS_ENT dir_ent;
 } DOS_FILE;
 
+#define FAT_CACHE_MAX_WIN   64  /* bigger cache uses bigger windows */
+#define FAT_WIN_NONE        ((uint32_t)-1)
+
 typedef struct {
-    uint32_t start; /* start cluster number of fat cache */
-    uint32_t cnt;       /* # of clusters in fat cache */
-    uint32_t first_cpc; /* # of clusters in first fat cache */
-    uint32_t last_cpc;  /* # of clusters in last fat cache */
-    uint32_t cpc;       /* clusters per cache - # of clusters per fat cache */
-    uint32_t diff;      /* diff from fat start and mmap aligned address */
+    uint32_t index;     /* window number from mmap aligned FAT start */
+    unsigned long used; /* last used time for LRU */
     char *addr;
+} FAT_WINDOW;
+
+typedef struct {
+    loff_t base;        /* mmap aligned address of FAT start */
+    uint32_t diff;      /* diff from fat start and mmap aligned address */
+    uint32_t size;      /* size of a window, multiple of FAT_CACHE_SIZE */
+    int nwin;           /* # of windows */
+    FAT_WINDOW *win;
+    FAT_WINDOW *last;   /* most recently used window */
+    unsigned long clock;
+    unsigned long hits;
+    unsigned long misses;
 } FAT_CACHE;
 
+/* changed FAT entries, not yet written by fs_write() */
+typedef struct {
+    uint32_t *cluster;  /* FAT_WIN_NONE if slot is empty */
+    uint32_t *value;
+    uint32_t size;      /* # of slots, power of 2 */
+    uint32_t cnt;       /* # of used slots */
+} FAT_OVERLAY;
+
 typedef struct {
     int nfats;
-    loff_t fat_start;
+    int fat_copies;     /* # of FATs in use, 1 if FAT32 mirroring is off */
+    loff_t fat_start;   /* start of the first FAT in use */
     unsigned int fat_size; /* unit is bytes */
     unsigned int fat_bits; /* size of a FAT entry */
     unsigned int eff_fat_bits; /* # of used bits in a FAT entry */
@@ -204,11 +241,12 @@ typedef struct {
     uint32_t free_clusters;
     uint32_t next_cluster;
     loff_t backupboot_start; /* 0 if not present */
-    unsigned int bitmap_size;
-    unsigned long *bitmap;  /* for marked cluster on disk */
-    unsigned long *real_bitmap; /* for real cluster chain through scan */
-    unsigned long *reclaim_bitmap;  /* for orphan cluster reclaiming */
+    unsigned int bitmap_size;   /* bytes of flat cluster bitmap */
+    BITMAP *bitmap;         /* for marked cluster on disk */
+    BITMAP *real_bitmap;    /* for real cluster chain through scan */
     FAT_CACHE fat_cache;
+    unsigned char *fat;     /* resident first FAT, FAT12/16 only */
+    FAT_OVERLAY fat_overlay;
     char *label;
 } DOS_FS;
 
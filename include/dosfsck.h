@@ -34,7 +34,7 @@ extern int interactive, list, verbose, test, write_immed;
 extern int remain_dirty;
 extern int atari_format;
 extern unsigned n_files;
-extern void *mem_queue;
+extern ARENA mem_queue;
 
 #endif
 
@@ -7,16 +7,51 @@
 #ifndef _FAT_H
 #define _FAT_H
 
+/* Run of contiguous clusters in a cluster chain */
+typedef struct fat_extent {
+    uint32_t start;     /* first cluster */
+    uint32_t len;       /* # of clusters, each but the last points to next */
+    uint32_t next;      /* FAT entry of the last cluster, -1 if EOF */
+} FAT_EXTENT;
+
 typedef enum fat_select {
     FAT_NONE = -1,
     FAT_FIRST = 0,
     FAT_SECOND = 1,
+    FAT_ENTRY = 2,      /* choose each differing entry */
 } fat_select_t;
 
+/* Sets how read_fat selects FAT when FATs differ but both are intact.
+   FAT_ENTRY takes each differing entry from the FAT in which it makes sense. */
+void set_fat_select(fat_select_t select);
+
+#define MAX_FAT_JOBS    64
+
+/* Sets the number of threads used by following read_fat.
+   Chunks of FAT which need repairing are handled by one thread in order. */
+void set_fat_jobs(int jobs);
+
+/* Sets the memory size of FAT32 cache used by following read_fat. */
+void set_fat_cache_size(long long size);
+void free_fat_cache(DOS_FS *fs);
+void print_fat_cache(DOS_FS *fs);
+
+#define BITMAP_FLAT_SIZE    (16 * 1024 * 1024)  /* 128M clusters */
+
+/* Sets the size limit of flat cluster bitmaps used by following read_fat.
+   Cluster bitmaps of larger volume are compressed. */
+void set_bitmap_flat_size(long long size);
+BITMAP *alloc_cluster_bitmap(DOS_FS *fs);
+void free_cluster_bitmaps(DOS_FS *fs);
+
 /* Loads the FAT of the file system described by FS. Initializes the FAT,
    replaces broken FATs and rejects invalid cluster entries. */
 void read_fat(DOS_FS *fs);
 
+/* Sets up access to the reserved FAT entries only, which hold the dirty
+   flag. FATs are neither read as a whole nor checked. */
+void read_fat_head(DOS_FS *fs);
+
 void get_fat_entry(DOS_FS *fs, uint32_t cluster, uint32_t *value, void *fat);
 void get_fat(DOS_FS *fs, uint32_t cluster, uint32_t *value);
 void modify_fat(DOS_FS *fs, uint32_t cluster, uint32_t new);
@@ -26,6 +61,8 @@ void clear_bitmap_reclaim(DOS_FS *fs, uint32_t cluster);
 
 void set_bitmap_occupied(DOS_FS *fs, uint32_t cluster);
 void clear_bitmap_occupied(DOS_FS *fs, uint32_t cluster);
+void set_bitmap_occupied_range(DOS_FS *fs, uint32_t cluster, uint32_t cnt);
+void clear_bitmap_occupied_range(DOS_FS *fs, uint32_t cluster, uint32_t cnt);
 
 void init_alloc_cluster(void);
 void inc_alloc_cluster(void);
@@ -37,6 +74,10 @@ void dec_alloc_cluster(void);
 void set_fat(DOS_FS *fs, uint32_t cluster, uint32_t new);
 void set_fat_immed(DOS_FS *fs, uint32_t cluster, uint32_t new);
 
+/* Writes FAT entries changed by set_fat to every FAT through fs_write.
+   Should be called before fs_flush. */
+void flush_fat(DOS_FS *fs);
+
 /* Returns a non-zero integer if the CLUSTERth cluster is marked as bad or zero
    otherwise. */
 int bad_cluster(DOS_FS *fs, uint32_t cluster);
@@ -51,6 +92,12 @@ uint32_t next_cluster(DOS_FS *fs, uint32_t cluster);
  * just return bad value */
 uint32_t __next_cluster(DOS_FS *fs, uint32_t cluster);
 
+/* Gets the extent of the cluster chain from CLUSTER, at most MAX clusters.
+   Contiguous clusters are found in FAT buffer without walking them one by
+   one. EXT->next is the following cluster as __next_cluster returns. */
+void get_fat_extent(DOS_FS *fs, uint32_t cluster, uint32_t max,
+        FAT_EXTENT *ext);
+
 /* Returns the byte offset of CLUSTER, relative to the respective device. */
 loff_t cluster_start(DOS_FS *fs, uint32_t cluster);
 
@@ -17,6 +17,32 @@
  * sufficient (or even better :) for 64 bit offsets in the meantime */
 #define llseek lseek
 
+#define FS_CACHE_SIZE   (256 * 1024)    /* default size of read cache */
+#define FS_CHANGE_SIZE  (4 * 1024 * 1024)   /* default memory of changes */
+
+/* Sets the size of read cache in bytes used by following fs_open.
+   Zero disables the cache. */
+void fs_set_cache_size(long long size);
+
+/* Sets the limit of memory in bytes holding data of pending changes. Data
+   of further changes is spilled to a scratch file. */
+void fs_set_change_limit(long long size);
+
+/* Sets the directory of the scratch file, TMPDIR or /tmp by default. */
+void fs_set_scratch_dir(char *path);
+
+/* Sets the journal file. Pending changes are saved to it before fs_flush
+   writes them, and it is marked committed when they are durable. */
+void fs_set_journal(char *path);
+
+/* Sets the I/O backend used by following fs_open, see io_open(). */
+void fs_set_backend(char *name);
+
+/* Sets the area of FATs from START to END (excluding). Changes are written
+   to FATs first, then to the rest of data and to the reserved sectors, and
+   to the boot sector last. */
+void fs_set_layout(loff_t start, loff_t end);
+
 /* Opens the file system PATH. If RW is zero, the file system is opened
    read-only, otherwise, it is opened read-write. */
 void fs_open(char *path, int rw);
@@ -27,10 +53,18 @@ void fs_find_data_copy(loff_t pos, int size, void *data);
    changes. */
 void fs_read(loff_t pos, int size, void *data);
 
+/* Same as fs_read, but reads from the disk directly without read cache.
+   It can be called from several threads unless changes are added meanwhile. */
+void fs_pread(loff_t pos, int size, void *data);
+
 /* Returns a non-zero integer if SIZE bytes starting at POS can be read without
    errors. Otherwise, it returns zero. */
 int fs_test(loff_t pos, int size);
 
+/* Reads 'cnt' areas of SIZE bytes at POS[] into read cache at once, as many
+   as the cache can hold. Following fs_read of them does not wait for I/O. */
+void fs_prefetch(loff_t *pos, int cnt, int size);
+
 /* If write_immed is non-zero, SIZE bytes are written from DATA to the disk,
    starting at POS. If write_immed is zero, the change is added to a list in
    memory. */
@@ -38,6 +72,13 @@ void fs_write(loff_t pos, int size, void *data);
 void fs_write_immed(loff_t pos, int size, void *data);
 
 int fs_flush(int write);
+
+/* Writes changes of the journal to the device again if writing them was
+   interrupted. Returns -1 if there is nothing to replay, otherwise a non-zero
+   integer if the file system is consistent after them, zero if not. */
+int fs_replay_journal(void);
+/* Makes all data written so far durable, including cache of the device */
+void fs_barrier(void);
 /* Closes the file system, performs all pending changes if WRITE is non-zero
    and removes the list of changes. Returns a non-zero integer if the file
    system has been changed since the last fs_open, zero otherwise. */
@@ -49,6 +90,12 @@ int fs_changed(void);
 void *fs_mmap(void *hint, off_t offset, size_t length);
 int fs_munmap(void *addr, size_t length);
 
+/* Print statistics of read cache */
+void fs_print_cache(void);
+
+/* Print statistics of writing changes */
+void fs_print_flush(void);
+
 /* Print wrong data in CHNAGE lists */
 void print_changes(void);
 
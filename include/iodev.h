@@ -0,0 +1,128 @@
+/* SPDX-FileCopyrightText : (c) 2026 LG Electronics Inc. */
+/* SPDX-License-Identifier : GPL-2.0 */
+
+/* iodev.h  -  I/O backends of device */
+
+#ifndef _IODEV_H
+#define _IODEV_H
+
+#include <sys/types.h> /* for loff_t */
+#include <sys/uio.h>
+
+#define IO_DEFAULT_BACKEND  "fd"
+
+typedef struct io_dev IO_DEV;
+
+/* Request of a batch, see io_submit() */
+typedef struct io_req {
+    int write;              /* non-zero to write, read otherwise */
+    const struct iovec *iov;
+    int cnt;
+    loff_t pos;
+    ssize_t res;            /* bytes done, or -errno */
+} IO_REQ;
+
+/* Operations of a backend. Like system calls, they return -1 and set errno
+   on failure, except mmap which returns NULL. */
+typedef struct io_ops {
+    const char *name;
+    /* opens 'path' with open(2) 'flags', 'dev->opts' has backend options */
+    int (*open)(IO_DEV *dev, const char *path, int flags);
+    int (*close)(IO_DEV *dev);
+    ssize_t (*pread)(IO_DEV *dev, void *data, size_t size, loff_t pos);
+    ssize_t (*preadv)(IO_DEV *dev, const struct iovec *iov, int cnt,
+            loff_t pos);
+    ssize_t (*pwrite)(IO_DEV *dev, const void *data, size_t size, loff_t pos);
+    ssize_t (*pwritev)(IO_DEV *dev, const struct iovec *iov, int cnt,
+            loff_t pos);
+    /* runs independent requests at once and returns after all are done,
+       NULL if the backend does them one by one */
+    int (*submit)(IO_DEV *dev, IO_REQ *reqs, int cnt);
+    /* maps 'length' bytes at 'pos' read-only, 'pos' is page aligned */
+    void *(*mmap)(IO_DEV *dev, void *addr, size_t length, loff_t pos);
+    int (*munmap)(IO_DEV *dev, void *addr, size_t length);
+    /* writes back data from 'pos' to 'pos + length' and waits for it,
+       device may still have it in its cache */
+    int (*sync)(IO_DEV *dev, loff_t pos, loff_t length);
+    /* makes all written data durable, including cache of device */
+    int (*barrier)(IO_DEV *dev);
+    loff_t (*size)(IO_DEV *dev);
+} IO_OPS;
+
+struct io_dev {
+    const IO_OPS *ops;
+    int fd;         /* device or image file, opened by every backend */
+    char *opts;     /* options after ':' in backend name, NULL if none */
+    void *priv;     /* private data of backend */
+};
+
+extern const IO_OPS fd_ops;
+extern const IO_OPS mem_ops;
+extern const IO_OPS uring_ops;
+extern const IO_OPS fault_ops;
+
+/* Returns the backend of 'name' which may have ":options", NULL if unknown */
+const IO_OPS *io_find_backend(const char *name);
+
+/* Opens 'path' with backend 'name' ("fd", "mem", "uring" or "fault" with
+   options). "uring" falls back to "fd" if io_uring is not available.
+   Terminates the program on failure. */
+IO_DEV *io_open(const char *name, const char *path, int flags);
+int io_close(IO_DEV *dev);
+
+/* Runs 'cnt' requests which don't overlap each other, in any order.
+   Result of each is stored in its 'res'. Returns -1 if they could not be
+   submitted, 0 otherwise. */
+int io_submit(IO_DEV *dev, IO_REQ *reqs, int cnt);
+
+static inline ssize_t io_pread(IO_DEV *dev, void *data, size_t size,
+        loff_t pos)
+{
+    return dev->ops->pread(dev, data, size, pos);
+}
+
+static inline ssize_t io_preadv(IO_DEV *dev, const struct iovec *iov,
+        int cnt, loff_t pos)
+{
+    return dev->ops->preadv(dev, iov, cnt, pos);
+}
+
+static inline ssize_t io_pwrite(IO_DEV *dev, const void *data, size_t size,
+        loff_t pos)
+{
+    return dev->ops->pwrite(dev, data, size, pos);
+}
+
+static inline ssize_t io_pwritev(IO_DEV *dev, const struct iovec *iov,
+        int cnt, loff_t pos)
+{
+    return dev->ops->pwritev(dev, iov, cnt, pos);
+}
+
+static inline void *io_mmap(IO_DEV *dev, void *addr, size_t length,
+        loff_t pos)
+{
+    return dev->ops->mmap(dev, addr, length, pos);
+}
+
+static inline int io_munmap(IO_DEV *dev, void *addr, size_t length)
+{
+    return dev->ops->munmap(dev, addr, length);
+}
+
+static inline int io_sync(IO_DEV *dev, loff_t pos, loff_t length)
+{
+    return dev->ops->sync(dev, pos, length);
+}
+
+static inline int io_barrier(IO_DEV *dev)
+{
+    return dev->ops->barrier(dev);
+}
+
+static inline loff_t io_size(IO_DEV *dev)
+{
+    return dev->ops->size(dev);
+}
+
+#endif
@@ -0,0 +1,368 @@
+/* SPDX-FileCopyrightText : (c) 2026 LG Electronics Inc. */
+/* SPDX-License-Identifier : GPL-2.0 */
+
+/* bitmap.c  -  Cluster bitmaps */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "bitmap.h"
+
+#define BITMAP_CHUNK_SIZE   (BITMAP_CHUNK_WORDS * sizeof(long))
+
+/* shared chunks of compressed bitmap */
+static unsigned long zero_chunk[BITMAP_CHUNK_WORDS];
+static unsigned long full_chunk[BITMAP_CHUNK_WORDS];
+
+static inline int is_shared(unsigned long *p)
+{
+    return p == zero_chunk || p == full_chunk;
+}
+
+BITMAP *alloc_bitmap(unsigned int bits, int compress)
+{
+    BITMAP *bm;
+    unsigned long *area;
+    unsigned int i;
+
+    bm = alloc_mem(sizeof(BITMAP));
+    /* one more chunk than needed, so 'bits' itself can be addressed */
+    bm->nchunks = bits / BITMAP_CHUNK_BITS + 1;
+    bm->bits = bm->nchunks * BITMAP_CHUNK_BITS;
+    bm->chunk = alloc_mem(bm->nchunks * sizeof(unsigned long *));
+
+    if (compress) {
+        if (!full_chunk[0])
+            memset(full_chunk, 0xff, BITMAP_CHUNK_SIZE);
+
+        bm->weight = alloc_mem(bm->nchunks * sizeof(unsigned int));
+        for (i = 0; i < bm->nchunks; i++)
+            bm->chunk[i] = zero_chunk;
+    }
+    else {
+        area = alloc_mem(bm->nchunks * BITMAP_CHUNK_SIZE);
+        for (i = 0; i < bm->nchunks; i++)
+            bm->chunk[i] = area + i * BITMAP_CHUNK_WORDS;
+    }
+
+    return bm;
+}
+
+void free_bitmap(BITMAP *bm)
+{
+    unsigned int i;
+
+    if (!bm)
+        return;
+
+    if (bm->weight) {
+        for (i = 0; i < bm->nchunks; i++) {
+            if (!is_shared(bm->chunk[i]))
+                free_mem(bm->chunk[i]);
+        }
+        free_mem(bm->weight);
+    }
+    else {
+        free_mem(bm->chunk[0]);
+    }
+
+    free_mem(bm->chunk);
+    free_mem(bm);
+}
+
+/* Returns chunk 'c' to be modified, shared chunk is copied */
+static unsigned long *get_chunk(BITMAP *bm, unsigned int c)
+{
+    unsigned long *p = bm->chunk[c];
+
+    if (!is_shared(p))
+        return p;
+
+    bm->chunk[c] = alloc_mem(BITMAP_CHUNK_SIZE);
+    if (p == full_chunk)
+        memset(bm->chunk[c], 0xff, BITMAP_CHUNK_SIZE);
+
+    return bm->chunk[c];
+}
+
+/* Replaces chunk 'c' with shared one if its bits are all clear or all set */
+static void put_chunk(BITMAP *bm, unsigned int c)
+{
+    unsigned long *p = bm->chunk[c];
+
+    if (!bm->weight || is_shared(p))
+        return;
+
+    if (bm->weight[c] == 0)
+        bm->chunk[c] = zero_chunk;
+    else if (bm->weight[c] == BITMAP_CHUNK_BITS)
+        bm->chunk[c] = full_chunk;
+    else
+        return;
+
+    free_mem(p);
+}
+
+/* Sets chunk 'c' of compressed bitmap to shared one */
+static void share_chunk(BITMAP *bm, unsigned int c, unsigned long *shared)
+{
+    if (!is_shared(bm->chunk[c]))
+        free_mem(bm->chunk[c]);
+
+    bm->chunk[c] = shared;
+    bm->weight[c] = shared == full_chunk ? BITMAP_CHUNK_BITS : 0;
+}
+
+/* Returns the number of bits from 'nr' before 'end' in the chunk of 'nr' */
+static inline unsigned int chunk_span(unsigned int nr, unsigned int end)
+{
+    unsigned int n = BITMAP_CHUNK_BITS - nr % BITMAP_CHUNK_BITS;
+
+    return end - nr < n ? end - nr : n;
+}
+
+void bitmap_set_bit(BITMAP *bm, unsigned int nr)
+{
+    unsigned int c = nr / BITMAP_CHUNK_BITS;
+    unsigned int w = BIT_WORD(nr % BITMAP_CHUNK_BITS);
+    unsigned long mask = BIT_MASK(nr);
+    unsigned long *p;
+
+    if (bm->chunk[c][w] & mask)
+        return;
+
+    p = get_chunk(bm, c);
+    p[w] |= mask;
+    if (bm->weight) {
+        bm->weight[c]++;
+        put_chunk(bm, c);
+    }
+}
+
+void bitmap_clear_bit(BITMAP *bm, unsigned int nr)
+{
+    unsigned int c = nr / BITMAP_CHUNK_BITS;
+    unsigned int w = BIT_WORD(nr % BITMAP_CHUNK_BITS);
+    unsigned long mask = BIT_MASK(nr);
+    unsigned long *p;
+
+    if (!(bm->chunk[c][w] & mask))
+        return;
+
+    p = get_chunk(bm, c);
+    p[w] &= ~mask;
+    if (bm->weight) {
+        bm->weight[c]--;
+        put_chunk(bm, c);
+    }
+}
+
+void bitmap_store_word(BITMAP *bm, unsigned int index, unsigned long word)
+{
+    unsigned int c = index / BITMAP_CHUNK_WORDS;
+    unsigned int w = index % BITMAP_CHUNK_WORDS;
+    unsigned long *p;
+
+    if (bm->chunk[c][w] == word)
+        return;
+
+    p = get_chunk(bm, c);
+    if (bm->weight) {
+        bm->weight[c] += __builtin_popcountl(word);
+        bm->weight[c] -= __builtin_popcountl(p[w]);
+    }
+    p[w] = word;
+    put_chunk(bm, c);
+}
+
+void bitmap_set_range(BITMAP *bm, unsigned int nr, unsigned int cnt)
+{
+    unsigned int end = nr + cnt;
+    unsigned int c, off, n;
+    unsigned long *p;
+
+    for (; nr < end; nr += n) {
+        c = nr / BITMAP_CHUNK_BITS;
+        off = nr % BITMAP_CHUNK_BITS;
+        n = chunk_span(nr, end);
+
+        if (!bm->weight) {
+            set_bits(off, n, bm->chunk[c]);
+        }
+        else if (n == BITMAP_CHUNK_BITS) {
+            share_chunk(bm, c, full_chunk);
+        }
+        else if (bm->chunk[c] != full_chunk) {
+            p = get_chunk(bm, c);
+            bm->weight[c] += n - count_bits(off, n, p);
+            set_bits(off, n, p);
+            put_chunk(bm, c);
+        }
+    }
+}
+
+void bitmap_clear_range(BITMAP *bm, unsigned int nr, unsigned int cnt)
+{
+    unsigned int end = nr + cnt;
+    unsigned int c, off, n;
+    unsigned long *p;
+
+    for (; nr < end; nr += n) {
+        c = nr / BITMAP_CHUNK_BITS;
+        off = nr % BITMAP_CHUNK_BITS;
+        n = chunk_span(nr, end);
+
+        if (!bm->weight) {
+            clear_bits(off, n, bm->chunk[c]);
+        }
+        else if (n == BITMAP_CHUNK_BITS) {
+            share_chunk(bm, c, zero_chunk);
+        }
+        else if (bm->chunk[c] != zero_chunk) {
+            p = get_chunk(bm, c);
+            bm->weight[c] -= count_bits(off, n, p);
+            clear_bits(off, n, p);
+            put_chunk(bm, c);
+        }
+    }
+}
+
+unsigned int bitmap_count(BITMAP *bm, unsigned int nr, unsigned int cnt)
+{
+    unsigned int end = nr + cnt;
+    unsigned int c, off, n;
+    unsigned int weight = 0;
+
+    for (; nr < end; nr += n) {
+        c = nr / BITMAP_CHUNK_BITS;
+        off = nr % BITMAP_CHUNK_BITS;
+        n = chunk_span(nr, end);
+
+        if (bm->chunk[c] == full_chunk)
+            weight += n;
+        else if (bm->chunk[c] != zero_chunk)
+            weight += count_bits(off, n, bm->chunk[c]);
+    }
+
+    return weight;
+}
+
+unsigned int bitmap_find_next(BITMAP *bm, unsigned int nr, unsigned int end)
+{
+    unsigned int c, off, n, bit;
+
+    for (; nr < end; nr += n) {
+        c = nr / BITMAP_CHUNK_BITS;
+        off = nr % BITMAP_CHUNK_BITS;
+        n = chunk_span(nr, end);
+
+        if (bm->chunk[c] == full_chunk)
+            return nr;
+        if (bm->chunk[c] == zero_chunk)
+            continue;
+
+        bit = find_next_bit(off, off + n, bm->chunk[c]);
+        if (bit < off + n)
+            return nr - off + bit;
+    }
+
+    return end;
+}
+
+unsigned int bitmap_find_next_zero(BITMAP *bm, unsigned int nr,
+        unsigned int end)
+{
+    unsigned int c, off, n, bit;
+
+    for (; nr < end; nr += n) {
+        c = nr / BITMAP_CHUNK_BITS;
+        off = nr % BITMAP_CHUNK_BITS;
+        n = chunk_span(nr, end);
+
+        if (bm->chunk[c] == zero_chunk)
+            return nr;
+        if (bm->chunk[c] == full_chunk)
+            continue;
+
+        bit = find_next_zero_bit(off, off + n, bm->chunk[c]);
+        if (bit < off + n)
+            return nr - off + bit;
+    }
+
+    return end;
+}
+
+void bitmap_zero(BITMAP *bm)
+{
+    unsigned int c;
+
+    if (!bm->weight) {
+        memset(bm->chunk[0], 0, bm->nchunks * BITMAP_CHUNK_SIZE);
+        return;
+    }
+
+    for (c = 0; c < bm->nchunks; c++)
+        share_chunk(bm, c, zero_chunk);
+}
+
+void bitmap_xor(BITMAP *dst, BITMAP *src)
+{
+    unsigned long *s, *d;
+    unsigned int c, i;
+
+    for (c = 0; c < dst->nchunks; c++) {
+        s = src->chunk[c];
+        d = dst->chunk[c];
+        if (s == zero_chunk)
+            continue;
+
+        if (dst->weight && s == full_chunk && is_shared(d)) {
+            share_chunk(dst, c, d == zero_chunk ? full_chunk : zero_chunk);
+            continue;
+        }
+
+        d = get_chunk(dst, c);
+        if (s == full_chunk) {
+            for (i = 0; i < BITMAP_CHUNK_WORDS; i++)
+                d[i] = ~d[i];
+        }
+        else {
+            xor_bitmap(d, s, BITMAP_CHUNK_WORDS);
+        }
+
+        if (dst->weight) {
+            dst->weight[c] = count_bits(0, BITMAP_CHUNK_BITS, d);
+            put_chunk(dst, c);
+        }
+    }
+}
+
+void bitmap_andnot(BITMAP *dst, BITMAP *src)
+{
+    unsigned long *s, *d;
+    unsigned int c;
+
+    for (c = 0; c < dst->nchunks; c++) {
+        s = src->chunk[c];
+        d = dst->chunk[c];
+        if (s == zero_chunk || d == zero_chunk)
+            continue;
+
+        if (s == full_chunk) {
+            if (dst->weight)
+                share_chunk(dst, c, zero_chunk);
+            else
+                memset(d, 0, BITMAP_CHUNK_SIZE);
+            continue;
+        }
+
+        d = get_chunk(dst, c);
+        andnot_bitmap(d, s, BITMAP_CHUNK_WORDS);
+
+        if (dst->weight) {
+            dst->weight[c] = count_bits(0, BITMAP_CHUNK_BITS, d);
+            put_chunk(dst, c);
+        }
+    }
+}
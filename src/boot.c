@@ -34,6 +34,14 @@ static struct {
     { 0xff, "5.25\" 320k floppy 2s/40tr/8sec" },
 };
 
+/* compare and write all FATs even if FAT32 mirroring is disabled */
+static int all_fats = 0;
+
+void set_all_fats(int all)
+{
+    all_fats = all;
+}
+
 static char *get_media_descr(unsigned char media)
 {
     int i;
@@ -70,9 +78,12 @@ static void dump_boot(DOS_FS *fs, struct boot_sector *b, unsigned lss)
     printf("%10d reserved sector%s\n", CF_LE_W(b->reserved_cnt),
             CF_LE_W(b->reserved_cnt) == 1 ? "" : "s");
     printf("First FAT starts at byte %llu (sector %llu)\n",
-            (unsigned long long)fs->fat_start,
-            (unsigned long long)fs->fat_start/lss);
+            (unsigned long long)CF_LE_W(b->reserved_cnt) * lss,
+            (unsigned long long)CF_LE_W(b->reserved_cnt));
     printf("%10d FATs, %d bit entries\n", b->nfats, fs->fat_bits);
+    if (fs->fat_copies < b->nfats)
+        printf("FAT mirroring disabled, using FAT %d only\n",
+                (CF_LE_W(b->fat32.flags) & FAT32_ACTIVE_FAT) + 1);
     printf("%10d bytes per FAT (= %u sectors)\n", fs->fat_size,
             fs->fat_size/lss);
     if (!fs->root_cluster) {
@@ -391,6 +402,7 @@ void read_boot(DOS_FS *fs)
     off_t data_size;
     struct volume_info *vi;
 
+    memset(fs, 0, sizeof(DOS_FS));
     fs_read(0, sizeof(b), &b);
 
     if (!is_valid_boot(fs, &b)) {
@@ -428,10 +440,6 @@ void read_boot(DOS_FS *fs)
         die("Cluster size is zero.");
     }
 
-    if (b.nfats > 2) {
-        printf("WARN: only 1 or 2 FATs are supported, %d FATs are not supported.\n", b.nfats);
-    }
-
     fs->nfats = b.nfats;
     sectors = GET_UNALIGNED_W(b.sectors);
     total_sectors = sectors ? sectors : CF_LE_L(b.total_sect);
@@ -449,6 +457,7 @@ void read_boot(DOS_FS *fs)
     fs->root_entries = GET_UNALIGNED_W(b.dir_entries);
     fs->data_start = fs->root_start +
         ROUND_TO_MULTIPLE(fs->root_entries << MSDOS_DIR_BITS, logical_sector_size);
+    fs_set_layout(fs->fat_start, fs->root_start);
     data_size = (off_t)total_sectors * logical_sector_size - fs->data_start;
     fs->clusters = data_size / fs->cluster_size;    /* total number of clusters */
     max_clus_num = fs->clusters + FAT_START_ENT;    /* maximum cluster no. */
@@ -507,6 +516,22 @@ void read_boot(DOS_FS *fs)
     fs->eff_fat_bits = (fs->fat_bits == 32) ? 28 : fs->fat_bits;
     fs->fat_size = sec_per_fat * logical_sector_size;
 
+    /* If mirroring is off, only active FAT is read and written */
+    fs->fat_copies = b.nfats;
+    if (fs->fat_bits == 32 && (CF_LE_W(b.fat32.flags) & FAT32_NO_MIRROR) &&
+            !all_fats) {
+        int active = CF_LE_W(b.fat32.flags) & FAT32_ACTIVE_FAT;
+
+        if (active < b.nfats) {
+            fs->fat_start += (loff_t)fs->fat_size * active;
+            fs->fat_copies = 1;
+        }
+        else {
+            printf("Active FAT %d doesn't exist. Using all FATs.\n",
+                    active + 1);
+        }
+    }
+
     fs->label = calloc(12, sizeof (__u8));
     if (fs->fat_bits == 12 || fs->fat_bits == 16) {
         vi = &b.oldfat.vi;
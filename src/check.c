@@ -31,9 +31,9 @@ static int check_dots(DOS_FS *fs, DOS_FILE *parent, int dots);
 static int add_dot_entries(DOS_FS *fs, DOS_FILE *parent, int dots);
 static int check_file_owner(DOS_FS *fs, DOS_FILE *walk, uint32_t cluster,
         int cnt);
-static DOS_FILE *find_owner(DOS_FS *fs, uint32_t cluster);
+static DOS_FILE *find_owner(DOS_FS *fs, DOS_FILE *file, uint32_t cluster);
 static void add_file(DOS_FS *fs, DOS_FILE ***chain, DOS_FILE *parent,
-        loff_t offset, FDSC **cp);
+        loff_t offset, DIR_ENT *dent, FDSC **cp);
 
 static DOS_FILE *root;
 
@@ -219,8 +219,8 @@ DOS_FILE *check_found_dir(DOS_FS *fs, int *post_num)
 {
     DOS_FILE *walk = NULL;
     DOS_FILE *found = NULL;
-    DIR_ENT *de = {0, };
-    DIR_ENT *found_de;
+    DOS_ENT *de = NULL;
+    DOS_ENT *found_de;
 
     for (walk = root->first; walk; walk = walk->next) {
         de = &walk->dir_ent;
@@ -325,7 +325,7 @@ uint32_t alloc_found_entry(DOS_FS *fs, int force_create)
         else {
             chain = &root->first;
         }
-        add_file(fs, &chain, root, offset, NULL);
+        add_file(fs, &chain, root, offset, &de, NULL);
     }
     else {
         new = FSTART(dir, fs);
@@ -458,6 +458,32 @@ loff_t alloc_rootdir_entry(DOS_FS *fs, DIR_ENT *de, const char *pattern)
     return offset;
 }
 
+/* Keep fields of directory entry 'de' in 'ent' */
+static void set_dos_ent(DOS_ENT *ent, DIR_ENT *de)
+{
+    memcpy(ent->name, de->name, LEN_FILE_NAME);
+    ent->attr = de->attr;
+    ent->starthi = de->starthi;
+    ent->start = de->start;
+    ent->size = de->size;
+}
+
+/* Get whole directory entry of file. Fields not kept in DOS_FILE are read
+ * from the device with pending changes, and are zero for FAT32 root */
+static void get_dir_ent(DOS_FILE *file, DIR_ENT *de)
+{
+    if (file->offset)
+        fs_read(file->offset, sizeof(DIR_ENT), de);
+    else
+        memset(de, 0, sizeof(DIR_ENT));
+
+    memcpy(de->name, file->dir_ent.name, LEN_FILE_NAME);
+    de->attr = file->dir_ent.attr;
+    de->starthi = file->dir_ent.starthi;
+    de->start = file->dir_ent.start;
+    de->size = file->dir_ent.size;
+}
+
 static char *path_name(DOS_FILE *file)
 {
     static char path[PATH_MAX * 2];
@@ -502,9 +528,10 @@ static char *file_stat(DOS_FILE *file)
     struct tm *tm;
     char tmp[128];
     time_t date;
+    DIR_ENT de;
 
-    date = date_dos2unix(CF_LE_W(file->dir_ent.time),
-            CF_LE_W(file->dir_ent.date));
+    get_dir_ent(file, &de);
+    date = date_dos2unix(CF_LE_W(de.time), CF_LE_W(de.date));
     tm = localtime(&date);
     strftime(tmp, 127, "%H:%M:%S %b %d %Y", tm);
     sprintf(temp,"  Size %u bytes, date %s", CF_LE_L(file->dir_ent.size), tmp);
@@ -600,7 +627,7 @@ static void clear_drop_file(DOS_FS *fs, DOS_FILE *file)
     for (curr = FSTART(file, fs);
             curr > 0 && curr < max_clus_num;
             curr = next_cluster(fs, curr)) {
-        clear_bit(curr, fs->real_bitmap);
+        bitmap_clear_bit(fs->real_bitmap, curr);
         dec_alloc_cluster();
     }
 }
@@ -614,23 +641,34 @@ static void drop_file(DOS_FS *fs, DOS_FILE *file)
 
 static void truncate_file(DOS_FS *fs, DOS_FILE *file, uint32_t clusters)
 {
-    int deleting;
-    uint32_t walk, next;
+    FAT_EXTENT ext;
+    uint32_t walk, i;
 
     walk = FSTART(file, fs);
-    if ((deleting = !clusters))
+    if (!clusters)
         MODIFY_START(file, 0, fs);
 
+    /* skip extents of clusters to keep */
+    while (clusters && walk > 0 && walk != -1) {
+        get_fat_extent(fs, walk, clusters, &ext);
+        if (FAT_IS_BAD(fs, ext.next))
+            die("Internal error: next_cluster on bad cluster");
+
+        clusters -= ext.len;
+        if (!clusters)
+            set_fat(fs, walk + ext.len - 1, -1);
+        walk = ext.next;
+    }
+
     while (walk > 0 && walk != -1) {
-        next = next_cluster(fs, walk);
-        if (deleting) {
-            set_fat(fs, walk, 0);
-            clear_bitmap_occupied(fs, walk);
-        }
-        else if ((deleting = !--clusters)) {
-            set_fat(fs, walk, -1);
-        }
-        walk = next;
+        get_fat_extent(fs, walk, -1, &ext);
+        if (FAT_IS_BAD(fs, ext.next))
+            die("Internal error: next_cluster on bad cluster");
+
+        for (i = 0; i < ext.len; i++)
+            set_fat(fs, walk + i, 0);
+        clear_bitmap_occupied_range(fs, walk, ext.len);
+        walk = ext.next;
     }
 }
 
@@ -680,7 +718,7 @@ static int find_lfn(DOS_FS *fs, DOS_FILE *parent, DOS_FILE *file)
             if (!IS_LFN_ENT(de.attr) && !IS_VOLUME_LABEL(de.attr)) {
                 if (!file->offset) {
                     file->offset = off;
-                    memcpy(&file->dir_ent, &de, sizeof(DIR_ENT));
+                    set_dos_ent(&file->dir_ent, &de);
                 }
                 break;
             }
@@ -730,7 +768,169 @@ void remove_lfn(DOS_FS *fs, DOS_FILE *file)
     interactive = save_interactive;
 }
 
-static void auto_rename(DOS_FS *fs, DOS_FILE *file)
+/*
+ * Hash table of 8.3 names of entries in a directory for finding duplicates
+ * and unique names for auto-renaming. Nodes and buckets are kept and reused
+ * for the next directory.
+ */
+typedef struct _name_node {
+    DOS_FILE *file;
+    int index;          /* order in directory */
+    int dropped;        /* dropped, should be unlinked from directory */
+    unsigned char name[MSDOS_NAME]; /* name when node was hashed */
+    struct _name_node *hnext;
+} NAME_NODE;
+
+static struct {
+    NAME_NODE *nodes;
+    NAME_NODE **buckets;
+    int cnt;
+    int max_cnt;
+    unsigned int mask;
+    uint32_t number;    /* auto-rename numbers below it are all used */
+} names;
+
+#define AUTO_RENAME_MAX     9999999
+
+static unsigned int hash_name(unsigned char *name)
+{
+    unsigned int hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < MSDOS_NAME; i++)
+        hash = (hash ^ name[i]) * 16777619U;
+
+    return hash & names.mask;
+}
+
+/* Returns the number of auto-renamed name, or -1 if it is not */
+static int auto_rename_number(unsigned char *name)
+{
+    int number = 0;
+    int i;
+
+    if (strncmp((char *)name, "FSCK", 4))
+        return -1;
+
+    for (i = 4; i < MSDOS_NAME; i++) {
+        if (name[i] < '0' || name[i] > '9')
+            return -1;
+        number = number * 10 + name[i] - '0';
+    }
+
+    return number;
+}
+
+/* Link node in hash chain, keep nodes of same name in directory order */
+static void insert_name(NAME_NODE *node)
+{
+    NAME_NODE **link;
+
+    memcpy(node->name, node->file->dir_ent.name, MSDOS_NAME);
+    for (link = &names.buckets[hash_name(node->name)]; *link;
+            link = &(*link)->hnext) {
+        if ((*link)->index > node->index)
+            break;
+    }
+
+    node->hnext = *link;
+    *link = node;
+}
+
+static void remove_name(NAME_NODE *node)
+{
+    NAME_NODE **link;
+    int number;
+
+    for (link = &names.buckets[hash_name(node->name)]; *link != node;
+            link = &(*link)->hnext)
+        ;
+    *link = node->hnext;
+
+    number = auto_rename_number(node->name);
+    if (number >= 0 && number < names.number)
+        names.number = number;
+}
+
+/* Rehash node if the name of file has been changed */
+static void update_name(NAME_NODE *node)
+{
+    if (memcmp(node->name, node->file->dir_ent.name, MSDOS_NAME)) {
+        remove_name(node);
+        insert_name(node);
+    }
+}
+
+static void drop_name(NAME_NODE *node)
+{
+    remove_name(node);
+    node->dropped = 1;
+}
+
+/* Returns the first node after 'index' in directory that has 'name'.
+ * Volume labels are not counted. */
+static NAME_NODE *next_name(unsigned char *name, int index)
+{
+    NAME_NODE *node;
+
+    for (node = names.buckets[hash_name(name)]; node; node = node->hnext) {
+        if (node->index > index &&
+                !IS_VOLUME_LABEL(node->file->dir_ent.attr) &&
+                !memcmp(node->name, name, MSDOS_NAME))
+            return node;
+    }
+
+    return NULL;
+}
+
+static int find_name(unsigned char *name)
+{
+    NAME_NODE *node;
+
+    for (node = names.buckets[hash_name(name)]; node; node = node->hnext) {
+        if (!memcmp(node->name, name, MSDOS_NAME))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void build_names(DOS_FILE *first)
+{
+    DOS_FILE *walk;
+    int cnt;
+    int size;
+
+    for (cnt = 0, walk = first; walk; walk = walk->next)
+        cnt++;
+
+    if (cnt > names.max_cnt) {
+        free_mem(names.nodes);
+        free_mem(names.buckets);
+
+        for (size = 64; size < cnt * 2; size <<= 1)
+            ;
+        names.max_cnt = size / 2;
+        names.mask = size - 1;
+        names.nodes = alloc_mem(names.max_cnt * sizeof(NAME_NODE));
+        names.buckets = alloc_mem(size * sizeof(NAME_NODE *));
+    }
+    else {
+        memset(names.buckets, 0, (names.mask + 1) * sizeof(NAME_NODE *));
+    }
+
+    names.cnt = cnt;
+    names.number = 0;
+    for (cnt = 0, walk = first; walk; walk = walk->next, cnt++) {
+        names.nodes[cnt].file = walk;
+        names.nodes[cnt].index = cnt;
+        names.nodes[cnt].dropped = 0;
+        insert_name(&names.nodes[cnt]);
+    }
+}
+
+/* 'node' is not NULL when file's directory is in name table */
+static void __auto_rename(DOS_FS *fs, DOS_FILE *file, NAME_NODE *node)
 {
     DOS_FILE *first, *walk;
     uint32_t number;
@@ -741,19 +941,36 @@ static void auto_rename(DOS_FS *fs, DOS_FILE *file)
 
     first = file->parent ? file->parent->first : root;
     number = 0;
+
+    if (node) {
+        /* all numbers below names.number are used by other files */
+        remove_name(node);
+        number = names.number;
+    }
+
     while (1) {
         snprintf(name, MSDOS_NAME + 1, "FSCK%04d%03d",
-                number / 1000, number % 1000);
+                (number / 1000) % 10000, number % 1000);
         memcpy(file->dir_ent.name, name, MSDOS_NAME);
 
-        for (walk = first; walk; walk = walk->next)
-            if (walk != file &&
-                    !strncmp((char *)walk->dir_ent.name,
-                        (char *)file->dir_ent.name, MSDOS_NAME)) {
-                break;
-            }
+        if (node) {
+            walk = find_name(file->dir_ent.name) ? file : NULL;
+        }
+        else {
+            for (walk = first; walk; walk = walk->next)
+                if (walk != file &&
+                        !strncmp((char *)walk->dir_ent.name,
+                            (char *)file->dir_ent.name, MSDOS_NAME)) {
+                    break;
+                }
+        }
 
         if (!walk) {
+            if (node) {
+                insert_name(node);
+                names.number = number + 1;
+            }
+
             fs_write(file->offset, MSDOS_NAME, file->dir_ent.name);
 
             /* remove lfn related with previous name */
@@ -763,13 +980,18 @@ static void auto_rename(DOS_FS *fs, DOS_FILE *file)
         }
 
         number++;
-        if (number > 9999999) {
+        if (number > AUTO_RENAME_MAX) {
             die("Too many files need repair.");
         }
     }
     die("Can't generate a unique name.");
 }
 
+static void auto_rename(DOS_FS *fs, DOS_FILE *file)
+{
+    __auto_rename(fs, file, NULL);
+}
+
 static void rename_file(DOS_FS *fs, DOS_FILE *file)
 {
     unsigned char name[46];
@@ -817,6 +1039,98 @@ static void check_time_fields(DIR_ENT *de)
 }
 #endif
 
+/*
+ * Cluster owner map.
+ *
+ * map[cluster] is an index into files[] of the file which set the bit of
+ * cluster in real_bitmap, 0 if unknown. A new index is given on every walk
+ * of a chain, so the map also tells whether a cluster was visited by the
+ * current walk. If the map is bigger than owner_map_size, it isn't used and
+ * owners are searched by walking the directory tree.
+ */
+static struct {
+    uint32_t *map;
+    DOS_FILE **files;   /* files[0] is not used */
+    uint32_t cnt;
+    uint32_t max_cnt;
+} owners;
+
+static long long owner_map_size = OWNER_MAP_SIZE;
+
+void set_owner_map_size(long long size)
+{
+    owner_map_size = size;
+}
+
+/* map is allocated in mem_queue, so it is released with each pass */
+static void init_owners(DOS_FS *fs)
+{
+    long long size = (long long)(fs->clusters + 2) * sizeof(uint32_t);
+
+    owners.map = NULL;
+    owners.cnt = 0;
+    if (size > owner_map_size)
+        return;
+
+    owners.map = qalloc(&mem_queue, size);
+}
+
+/* returns index of new walk of file's chain, 0 if map is not used */
+static uint32_t new_owner(DOS_FILE *file)
+{
+    DOS_FILE **files;
+
+    if (!owners.map)
+        return 0;
+
+    if (owners.cnt + 1 >= owners.max_cnt) {
+        owners.max_cnt = owners.max_cnt ? owners.max_cnt * 2 : 1024;
+        files = alloc_mem(owners.max_cnt * sizeof(DOS_FILE *));
+        if (owners.files) {
+            memcpy(files, owners.files, (owners.cnt + 1) * sizeof(DOS_FILE *));
+            free_mem(owners.files);
+        }
+        owners.files = files;
+    }
+
+    owners.files[++owners.cnt] = file;
+    return owners.cnt;
+}
+
+static inline void set_owner(uint32_t cluster, uint32_t index)
+{
+    if (owners.map)
+        owners.map[cluster] = index;
+}
+
+static inline void set_owner_range(uint32_t cluster, uint32_t cnt,
+        uint32_t index)
+{
+    uint32_t i;
+
+    if (owners.map) {
+        for (i = 0; i < cnt; i++)
+            owners.map[cluster + i] = index;
+    }
+}
+
+static inline uint32_t get_owner(uint32_t cluster)
+{
+    return owners.map ? owners.map[cluster] : 0;
+}
+
+/* get owner of cluster which is set in real_bitmap, other than 'file' */
+static DOS_FILE *lookup_owner(DOS_FS *fs, DOS_FILE *file, uint32_t cluster)
+{
+    uint32_t index;
+
+    index = get_owner(cluster);
+    if (index)
+        return owners.files[index];
+
+    return find_owner(fs, file, cluster);
+}
+
 /*
  * check lists in check_file().
  *
@@ -841,6 +1155,7 @@ static void check_time_fields(DIR_ENT *de)
 static int check_file(DOS_FS *fs, DOS_FILE *file)
 {
     DOS_FILE *owner = NULL;
+    FAT_EXTENT ext;
     int restart;
     uint32_t expect,
              curr,
@@ -850,9 +1165,14 @@ static int check_file(DOS_FS *fs, DOS_FILE *file)
              clusters2; /* num. of cluster occupied by previous entry
                            shared with same cluster */
     uint32_t next_clus;
+    uint32_t index;
+    uint32_t cnt;
 
 #ifdef DEBUG
-    check_time_fields(&file->dir_ent);
+    DIR_ENT de;
+
+    get_dir_ent(file, &de);
+    check_time_fields(&de);
 #endif
     if (!IS_DIR(file->dir_ent.attr) && !IS_FILE(file->dir_ent.attr) &&
             !IS_VOLUME_LABEL(file->dir_ent.attr)) {
@@ -970,11 +1290,25 @@ static int check_file(DOS_FS *fs, DOS_FILE *file)
         MODIFY_START(file, 0, fs);
     }
 
+    index = new_owner(file);
     clusters = prev = 0;
     for (curr = FSTART(file, fs) ? FSTART(file, fs) : -1;
             curr != -1; curr = next_clus) {
 
-        next_clus = __next_cluster(fs, curr);
+        /* clusters of extent before the last point to the next one,
+         * so occupy them at once up to the first shared one */
+        get_fat_extent(fs, curr, -1, &ext);
+        cnt = bitmap_find_next(fs->real_bitmap, curr,
+                curr + ext.len - 1) - curr;
+        if (cnt) {
+            set_bitmap_occupied_range(fs, curr, cnt);
+            set_owner_range(curr, cnt, index);
+            clusters += cnt;
+            curr += cnt;
+            prev = curr - 1;
+        }
+
+        next_clus = curr == ext.start + ext.len - 1 ? ext.next : curr + 1;
         if (!next_clus || FAT_IS_BAD(fs, next_clus) ||
                 (next_clus != -1 && next_clus >= max_clus_num)) {
             printf("%s\n  Contains a %s cluster (%u). Assuming EOF.\n",
@@ -991,6 +1325,7 @@ static int check_file(DOS_FS *fs, DOS_FILE *file)
                         fs->root_cluster);
                 set_fat(fs, curr, -1);
                 set_bitmap_occupied(fs, curr);
+                set_owner(curr, index);
                 clusters++;
             }
             else {
@@ -1007,7 +1342,7 @@ static int check_file(DOS_FS *fs, DOS_FILE *file)
         }
 
         /* check shared clusters */
-        if (test_bit(curr, fs->real_bitmap)) {
+        if (bitmap_test_bit(fs->real_bitmap, curr)) {
             /* already bit of curr is set in fs->real_bitmap */
             int do_trunc = 0;
 
@@ -1034,7 +1369,7 @@ static int check_file(DOS_FS *fs, DOS_FILE *file)
                     (do_trunc == 1 ||
                      (interactive && get_key("12", "?") == '1'))) {
 
-                owner = find_owner(fs, curr);
+                owner = lookup_owner(fs, file, curr);
                 if (!owner)
                     die("Cluster bitmap is set,"
                             " but bitmap's owner doesn't exist\n");
@@ -1105,6 +1440,7 @@ truncate_second:
             }
         }
         set_bitmap_occupied(fs, curr);
+        set_owner(curr, index);
         clusters++;
         prev = curr;
     }
@@ -1157,9 +1493,12 @@ static int check_files(DOS_FS *fs, DOS_FILE *start)
  */
 static int check_dir(DOS_FS *fs, DOS_FILE **root, int dots)
 {
-    DOS_FILE *parent, **walk, **scan;
+    DOS_FILE *parent, **walk, *scan;
+    NAME_NODE *wnode, *snode;
     int skip, redo;
     int good, bad;
+    int index;
+    int i;
 
     if (!*root)
         return 0;
@@ -1200,9 +1539,23 @@ static int check_dir(DOS_FS *fs, DOS_FILE **root, int dots)
         }
     }
 
+    build_names(*root);
+
     redo = 0;
     walk = root;
+    i = 0;
     while (*walk) {
+        /* find node of walk, nodes are in directory order */
+        while (names.nodes[i].file != *walk)
+            i++;
+        wnode = &names.nodes[i];
+
+        /* dropped as a duplicate of previous entry */
+        if (wnode->dropped) {
+            *walk = (*walk)->next;
+            continue;
+        }
+
         /* bad name check */
         if (!IS_VOLUME_LABEL((*walk)->dir_ent.attr) &&
                 bad_name((*walk)->dir_ent.name)) {
@@ -1222,14 +1575,17 @@ static int check_dir(DOS_FS *fs, DOS_FILE **root, int dots)
             switch (interactive ? get_key("1234", "?") : '3') {
                 case '1':
                     drop_file(fs, *walk);
+                    update_name(wnode);
                     walk = &(*walk)->next;
                     continue;
                 case '2':
                     rename_file(fs, *walk);
+                    update_name(wnode);
                     redo = 1;
                     break;
                 case '3':
-                    auto_rename(fs, *walk);
+                    __auto_rename(fs, *walk, wnode);
+                    update_name(wnode);
                     printf("  Renamed to %s\n",
                             file_name((*walk)->dir_ent.name));
                     break;
@@ -1240,59 +1596,64 @@ static int check_dir(DOS_FS *fs, DOS_FILE **root, int dots)
 
         /* don't check for duplicates of the volume label */
         if (!IS_VOLUME_LABEL((*walk)->dir_ent.attr)) {
-            scan = &(*walk)->next;
             skip = 0;
-            while (*scan && !skip) {
-                if (!IS_VOLUME_LABEL((*scan)->dir_ent.attr) &&
-                        !strncmp((char *)((*walk)->dir_ent.name),
-                            (char *)((*scan)->dir_ent.name), MSDOS_NAME)) {
-                    printf("%s\n  Duplicate directory entry.\n  First  %s\n",
-                            path_name(*walk), file_stat(*walk));
-                    printf("  Second %s\n", file_stat(*scan));
-
-                    if (interactive)
-                        printf("1) Drop first\n"
-                                "2) Drop second\n"
-                                "3) Rename first\n"
-                                "4) Rename second\n"
-                                "5) Auto-rename first\n"
-                                "6) Auto-rename second\n");
-                    else
-                        printf("  Auto-renaming second.\n");
-
-                    switch (interactive ? get_key("123456", "?") : '6') {
-                        case '1':
-                            drop_file(fs, *walk);
-                            *walk = (*walk)->next;
-                            skip = 1;
-                            break;
-                        case '2':
-                            drop_file(fs, *scan);
-                            *scan = (*scan)->next;
-                            continue;
-                        case '3':
-                            rename_file(fs, *walk);
-                            printf("  Renamed to %s\n", path_name(*walk));
-                            redo = 1;
-                            break;
-                        case '4':
-                            rename_file(fs, *scan);
-                            printf("  Renamed to %s\n", path_name(*walk));
-                            redo = 1;
-                            break;
-                        case '5':
-                            auto_rename(fs, *walk);
-                            printf("  Renamed to %s\n",
-                                    file_name((*walk)->dir_ent.name));
-                            break;
-                        case '6':
-                            auto_rename(fs, *scan);
-                            printf("  Renamed to %s\n",
-                                    file_name((*scan)->dir_ent.name));
-                            break;
-                    }
+            index = wnode->index;
+            while (!skip &&
+                    (snode = next_name((*walk)->dir_ent.name, index))) {
+                index = snode->index;
+                scan = snode->file;
+
+                printf("%s\n  Duplicate directory entry.\n  First  %s\n",
+                        path_name(*walk), file_stat(*walk));
+                printf("  Second %s\n", file_stat(scan));
+
+                if (interactive)
+                    printf("1) Drop first\n"
+                            "2) Drop second\n"
+                            "3) Rename first\n"
+                            "4) Rename second\n"
+                            "5) Auto-rename first\n"
+                            "6) Auto-rename second\n");
+                else
+                    printf("  Auto-renaming second.\n");
+
+                switch (interactive ? get_key("123456", "?") : '6') {
+                    case '1':
+                        drop_file(fs, *walk);
+                        drop_name(wnode);
+                        *walk = (*walk)->next;
+                        skip = 1;
+                        break;
+                    case '2':
+                        /* unlinked when walk reaches it */
+                        drop_file(fs, scan);
+                        drop_name(snode);
+                        break;
+                    case '3':
+                        rename_file(fs, *walk);
+                        update_name(wnode);
+                        printf("  Renamed to %s\n", path_name(*walk));
+                        redo = 1;
+                        break;
+                    case '4':
+                        rename_file(fs, scan);
+                        update_name(snode);
+                        printf("  Renamed to %s\n", path_name(*walk));
+                        redo = 1;
+                        break;
+                    case '5':
+                        __auto_rename(fs, *walk, wnode);
+                        update_name(wnode);
+                        printf("  Renamed to %s\n",
+                                file_name((*walk)->dir_ent.name));
+                        break;
+                    case '6':
+                        __auto_rename(fs, scan, snode);
+                        update_name(snode);
+                        printf("  Renamed to %s\n",
+                                file_name(scan->dir_ent.name));
+                        break;
                 }
-                scan = &(*scan)->next;
             }
 
             if (skip)
@@ -1303,6 +1664,7 @@ static int check_dir(DOS_FS *fs, DOS_FILE **root, int dots)
             walk = &(*walk)->next;
         else {
             walk = root;
+            i = 0;
             redo = 0;
         }
     }
@@ -1325,19 +1687,73 @@ static int check_dir(DOS_FS *fs, DOS_FILE **root, int dots)
  *    broken circular chain. if not(ie. other file's cluster),
  *    do nothing. check other place */
 
+/* returns the number of clusters from 'cluster' before one visited in the walk
+ * of 'index', at most 'cnt' */
+static uint32_t find_visited(uint32_t cluster, uint32_t cnt, uint32_t index)
+{
+    uint32_t i;
+
+    for (i = 0; i < cnt && owners.map[cluster + i] != index; i++)
+        ;
+
+    return i;
+}
+
+/* Validate the chain of file in one walk. Clusters visited in this walk
+ * are marked in owner map by index of the walk, so circular chain is found
+ * without touching real_bitmap. If owner map is not used, real_bitmap is
+ * set temporarily instead and cleared by walking the chain again. */
 static void check_file_chain(DOS_FS *fs, DOS_FILE *file, int read_test)
 {
+    FAT_EXTENT ext;
     uint32_t curr, prev, clusters, next;
+    uint32_t index, owner;
+    uint32_t cnt;
+    uint32_t fail_start = 0, fail_end = 0;  /* run which failed read test */
 
+    index = new_owner(file);
     prev = clusters = 0;
     for (curr = FSTART(file, fs);
             curr > 0 && curr < max_clus_num; curr = next) {
 
-        next = __next_cluster(fs, curr);
+        /* clusters of extent before the last point to the next one, so
+         * keep them at once up to the first one already in the chain.
+         * Read test is done for a run of at most CHAIN_TEST_SIZE bytes,
+         * and cluster by cluster after it fails */
+        get_fat_extent(fs, curr, read_test ?
+                max(CHAIN_TEST_SIZE / fs->cluster_size, 1) + 1 : -1, &ext);
+        cnt = bitmap_find_next(fs->real_bitmap, curr,
+                curr + ext.len - 1) - curr;
+        if (index)
+            cnt = find_visited(curr, cnt, index);
+
+        if (cnt && read_test &&
+                ((curr >= fail_start && curr < fail_end) ||
+                 !fs_test(cluster_start(fs, curr), cnt * fs->cluster_size))) {
+            if (curr < fail_start || curr >= fail_end) {
+                fail_start = curr;
+                fail_end = curr + cnt;
+            }
+            cnt = 0;
+        }
+
+        if (cnt) {
+            if (!index)
+                bitmap_set_range(fs->real_bitmap, curr, cnt);
+            set_owner_range(curr, cnt, index);
+            clusters += cnt;
+            curr += cnt;
+            prev = curr - 1;
+        }
+
+        next = curr == ext.start + ext.len - 1 ? ext.next : curr + 1;
 
-        /* check if bit of curr is set in fs->real_bitmap */
-        if (test_bit(curr, fs->real_bitmap)) {
-            if (check_file_owner(fs, file, curr, clusters)) {
+        /* check if curr is already in this chain or owned by other file */
+        owner = get_owner(curr);
+        if ((index && owner == index) ||
+                bitmap_test_bit(fs->real_bitmap, curr)) {
+            if (index ? owner == index :
+                    check_file_owner(fs, file, curr, clusters)) {
                 printf("%s\n  Circular cluster chain. "
                         "Truncating to %u cluster%s.\n",
                         path_name(file), clusters, clusters == 1 ? "" : "s");
@@ -1385,48 +1801,63 @@ static void check_file_chain(DOS_FS *fs, DOS_FILE *file, int read_test)
 
                 set_fat(fs, curr, -2);
                 clear_bitmap_occupied(fs, curr);
+                /* skipped cluster is not in chain any more */
+                bitmap_set_bit(fs->real_bitmap, curr);
+                set_owner(curr, 0);
+                continue;
             }
         }
         /* temporary set real_bitmap */
-        set_bit(curr, fs->real_bitmap);
+        if (!index)
+            bitmap_set_bit(fs->real_bitmap, curr);
+        set_owner(curr, index);
     }
 
-    for (curr = FSTART(file, fs);
-            curr > 0 && curr < max_clus_num; curr = next_cluster(fs, curr)) {
+    if (index)
+        return;
 
-        if (!clusters--)
-            break;
+    for (curr = FSTART(file, fs);
+            clusters && curr > 0 && curr < max_clus_num; curr = ext.next) {
+        get_fat_extent(fs, curr, clusters, &ext);
+        if (FAT_IS_BAD(fs, ext.next) && ext.len < clusters)
+            die("Internal error: next_cluster on bad cluster");
 
         /* clear real_bitmap */
-        clear_bit(curr, fs->real_bitmap);
+        bitmap_clear_range(fs->real_bitmap, curr, ext.len);
+        clusters -= ext.len;
     }
 }
 
 static void undelete(DOS_FS *fs, DOS_FILE *file)
 {
+    FAT_EXTENT ext;
     uint32_t clusters, left, prev, walk;
-    uint32_t value;
 
     clusters = left = (CF_LE_L(file->dir_ent.size) +
             fs->cluster_size - 1) / fs->cluster_size;
 
+    /* each cluster already points to the next one, so only the end of
+     * chain is set. do not set bitmap, because after calling undelete(),
+     * check_file() set bitmap */
     prev = 0;
     walk = FSTART(file, fs);
     do {
-        get_fat(fs, walk, &value);
-        if (!value)
-            break;
+        get_fat_extent(fs, walk, left ? left : 1, &ext);
 
-        left--;
-        if (prev) {
-            /* do not set bitmap, because after calling undelete(),
-             * check_file() set bitmap */
-            set_fat(fs, prev, walk);
+        /* the last cluster of extent is free */
+        if (!ext.next)
+            ext.len--;
+
+        if (ext.len) {
+            left -= ext.len;
+            prev = walk + ext.len - 1;
         }
-        prev = walk;
+
+        if (!ext.next)
+            break;
 
         /* CHECK: original code : walk++ is right? */
-        walk = value;
+        walk = ext.next;
     } while (left && walk >= FAT_START_ENT && walk < max_clus_num);
 
     if (prev) {
@@ -1448,15 +1879,19 @@ static void new_dir(void)
     lfn_reset();
 }
 
+/* 'dent' is the entry at offset which is already read by caller,
+ * if it is NULL, read it here. */
 static void add_file(DOS_FS *fs, DOS_FILE ***chain, DOS_FILE *parent,
-        loff_t offset, FDSC **cp)
+        loff_t offset, DIR_ENT *dent, FDSC **cp)
 {
     DOS_FILE *new;
     DIR_ENT de = {0, };
     FD_TYPE type;
     int rename_flag = 0;
 
-    if (offset)
+    if (offset && dent)
+        memcpy(&de, dent, sizeof(DIR_ENT));
+    else if (offset)
         fs_read(offset, sizeof(DIR_ENT), &de);
     else {
         memcpy(de.name, "           ", MSDOS_NAME);
@@ -1515,7 +1950,7 @@ static void add_file(DOS_FS *fs, DOS_FILE ***chain, DOS_FILE *parent,
     new = qalloc(&mem_queue, sizeof(DOS_FILE));
     new->lfn = lfn_get(&de);
     new->offset = offset;
-    memcpy(&new->dir_ent, &de, sizeof(de));
+    set_dos_ent(&new->dir_ent, &de);
     new->next = new->first = NULL;
     new->parent = parent;
 
@@ -1546,6 +1981,93 @@ static void add_file(DOS_FS *fs, DOS_FILE ***chain, DOS_FILE *parent,
     check_file_chain(fs, new, test);
 }
 
+/* Add entries of directory from 'offset' in cluster chain of 'clu_num'.
+ * Each cluster is read at once. */
+static void add_dir_entries(DOS_FS *fs, DOS_FILE ***chain, DOS_FILE *parent,
+        uint32_t clu_num, int offset, FDSC **cp)
+{
+    char *buf;
+    loff_t start;
+
+    buf = alloc_mem(fs->cluster_size);
+
+    while (clu_num > 0 && clu_num != -1) {
+        start = cluster_start(fs, clu_num);
+        fs_read(start, fs->cluster_size, buf);
+
+        do {
+            add_file(fs, chain, parent, start + (offset % fs->cluster_size),
+                    (DIR_ENT *)(buf + (offset % fs->cluster_size)), cp);
+            offset += sizeof(DIR_ENT);
+        } while (offset % fs->cluster_size);
+
+        if ((clu_num = next_cluster(fs, clu_num)) == 0 || clu_num == -1)
+            break;
+    }
+
+    free_mem(buf);
+}
+
+/* Add entries of root directory. In case of FAT12/16,
+ * read all entries at once. */
+static void add_root_entries(DOS_FS *fs, DOS_FILE ***chain)
+{
+    DIR_ENT *buf;
+    int i;
+
+    if (fs->root_cluster) {
+        add_file(fs, chain, NULL, 0, NULL, &fp_root);
+        return;
+    }
+
+    buf = alloc_mem(fs->root_entries * sizeof(DIR_ENT));
+    fs_read(fs->root_start, fs->root_entries * sizeof(DIR_ENT), buf);
+
+    for (i = 0; i < fs->root_entries; i++)
+        add_file(fs, chain, NULL, fs->root_start + i * sizeof(DIR_ENT),
+                &buf[i], &fp_root);
+
+    free_mem(buf);
+}
+
+#define PREFETCH_CLUSTERS   64  /* max clusters of directories read at once */
+
+static inline int is_data_cluster(DOS_FS *fs, uint32_t cluster)
+{
+    return cluster >= FAT_START_ENT && cluster < fs->clusters + FAT_START_ENT;
+}
+
+/* Read clusters of directory into read cache at once */
+static void prefetch_dir(DOS_FS *fs, DOS_FILE *dir)
+{
+    loff_t pos[PREFETCH_CLUSTERS];
+    uint32_t clu_num;
+    int cnt = 0;
+
+    for (clu_num = FSTART(dir, fs);
+            cnt < PREFETCH_CLUSTERS && is_data_cluster(fs, clu_num);
+            clu_num = __next_cluster(fs, clu_num))
+        pos[cnt++] = cluster_start(fs, clu_num);
+
+    fs_prefetch(pos, cnt, fs->cluster_size);
+}
+
+/* Read first clusters of subdirectories in list of 'first' at once */
+static void prefetch_subdirs(DOS_FS *fs, DOS_FILE *first)
+{
+    loff_t pos[PREFETCH_CLUSTERS];
+    DOS_FILE *walk;
+    int cnt = 0;
+
+    for (walk = first; walk && cnt < PREFETCH_CLUSTERS; walk = walk->next) {
+        if (IS_DIR(walk->dir_ent.attr) &&
+                is_data_cluster(fs, FSTART(walk, fs)))
+            pos[cnt++] = cluster_start(fs, FSTART(walk, fs));
+    }
+
+    fs_prefetch(pos, cnt, fs->cluster_size);
+}
+
 static int subdirs(DOS_FS *fs, DOS_FILE *parent, FDSC **cp);
 
 static int scan_dir(DOS_FS *fs, DOS_FILE *this, FDSC **cp)
@@ -1558,6 +2080,7 @@ static int scan_dir(DOS_FS *fs, DOS_FILE *this, FDSC **cp)
     chain = &this->first;
     offset = 0;
     clu_num = FSTART(this, fs);
+    prefetch_dir(fs, this);
 
     /* check here for first entry "." and second entry ".."
      * do not call add_file() for ".", ".." entries */
@@ -1580,15 +2103,7 @@ static int scan_dir(DOS_FS *fs, DOS_FILE *this, FDSC **cp)
     }
 
     new_dir();
-
-    while (clu_num > 0 && clu_num != -1) {
-        add_file(fs, &chain, this,
-                cluster_start(fs, clu_num) + (offset % fs->cluster_size), cp);
-        offset += sizeof(DIR_ENT);
-        if (!(offset % fs->cluster_size))
-            if ((clu_num = next_cluster(fs, clu_num)) == 0 || clu_num == -1)
-                break;
-    }
+    add_dir_entries(fs, &chain, this, clu_num, offset, cp);
 
     lfn_check_orphaned();
     if (check_dir(fs, &this->first, this->offset))
@@ -1604,6 +2119,7 @@ static int subdirs(DOS_FS *fs, DOS_FILE *parent, FDSC **cp)
 {
     DOS_FILE *walk;
 
+    prefetch_subdirs(fs, parent ? parent->first : root);
     for (walk = parent ? parent->first : root; walk; walk = walk->next) {
         if (IS_DIR(walk->dir_ent.attr)) {
             if (scan_dir(fs, walk, file_cd(cp, (char *)(walk->dir_ent.name))))
@@ -1616,22 +2132,14 @@ static int subdirs(DOS_FS *fs, DOS_FILE *parent, FDSC **cp)
 int scan_root(DOS_FS *fs)
 {
     DOS_FILE **chain;
-    int i;
 
     root = NULL;
     chain = &root;
 
     init_alloc_cluster();
+    init_owners(fs);
     new_dir();
-
-    if (fs->root_cluster) {
-        add_file(fs, &chain, NULL, 0, &fp_root);
-    }
-    else {
-        for (i = 0; i < fs->root_entries; i++)
-            add_file(fs, &chain, NULL,
-                    fs->root_start + i * sizeof(DIR_ENT), &fp_root);
-    }
+    add_root_entries(fs, &chain);
 
     lfn_check_orphaned();
     (void)check_dir(fs, &root, 0);
@@ -1646,36 +2154,16 @@ void scan_root_only(DOS_FS *fs, label_t **head, label_t **last)
 {
     DOS_FILE **chain;
     DOS_FILE *this;
-    int i;
-    int offset = 0;
-    uint32_t clus_num;
 
     root = NULL;
     chain = &root;
     new_dir();
-    if (fs->root_cluster) {
-        add_file(fs, &chain, NULL, 0, &fp_root);
-    }
-    else {
-        for (i = 0; i < fs->root_entries; i++)
-            add_file(fs, &chain, NULL,
-                    fs->root_start + i * sizeof(DIR_ENT), &fp_root);
-    }
+    add_root_entries(fs, &chain);
 
     chain = &root->first;
     this = root;
-    clus_num = FSTART(this, fs);
     lfn_reset();
-
-    while (clus_num > 0 && clus_num != -1) {
-        add_file(fs, &chain, this,
-                cluster_start(fs, clus_num) + (offset % fs->cluster_size),
-                NULL);
-        offset += sizeof(DIR_ENT);
-        if (!(offset % fs->cluster_size))
-            if ((clus_num = next_cluster(fs, clus_num)) == 0 || clus_num == -1)
-                break;
-    }
+    add_dir_entries(fs, &chain, this, FSTART(this, fs), 0, NULL);
 
     scan_volume_entry(fs, head, last);
     lfn_reset();
@@ -1810,7 +2298,7 @@ static void add_label_entry(DOS_FS *fs, DOS_FILE ***chain, DOS_FILE *parent,
     new = qalloc(&mem_queue, sizeof(DOS_FILE));
     new->lfn = lfn_get(de);
     new->offset = offset;
-    memcpy(&new->dir_ent, de, sizeof(*de));
+    set_dos_ent(&new->dir_ent, de);
     new->next = new->first = NULL;
     new->parent = parent;
 
@@ -1927,7 +2415,7 @@ void write_root_label(DOS_FS *fs, char *label, label_t **head, label_t **last)
         DOS_FILE *walk = (*head)->file;
 
         offset = walk->offset;
-        memcpy(&de, &walk->dir_ent, sizeof(de));
+        get_dir_ent(walk, &de);
         (*head)->flag = LABEL_FLAG_NONE;
     }
 
@@ -2024,10 +2512,13 @@ static void remove_boot_label(DOS_FS *fs)
  */
 static void remove_root_label(DOS_FILE *label)
 {
+    DIR_ENT de;
+
     if (label) {
         label->dir_ent.name[0] = DELETED_FLAG;
         label->dir_ent.attr = 0;
-        fs_write(label->offset, sizeof(DIR_ENT), &label->dir_ent);
+        get_dir_ent(label, &de);
+        fs_write(label->offset, sizeof(DIR_ENT), &de);
     }
 }
 
@@ -2365,6 +2856,7 @@ static int add_dot_entries(DOS_FS *fs, DOS_FILE *parent, int dots)
 
     DOS_FILE dot_file;
     DOS_FILE *file;
+    DIR_ENT dent, p_dent;
     DIR_ENT *de;
     DIR_ENT *p_de;
     char *entry_name;
@@ -2373,8 +2865,9 @@ static int add_dot_entries(DOS_FS *fs, DOS_FILE *parent, int dots)
     int ent_size;
 
     file = &dot_file;
-    de = &dot_file.dir_ent;
-    p_de = &parent->dir_ent;
+    de = &dent;
+    p_de = &p_dent;
+    get_dir_ent(parent, p_de);
 
     /* TODO: use free cluster hint field(info_sector's next_cluster) */
     /* find free cluster */
@@ -2432,6 +2925,7 @@ static int add_dot_entries(DOS_FS *fs, DOS_FILE *parent, int dots)
     set_fat(fs, start_clus, new_clus);
     set_fat(fs, new_clus, next_clus);
     set_bitmap_occupied(fs, new_clus);
+    set_owner(new_clus, new_owner(parent));
 
     if (dots == DOT_ENTRY) {
         /* first entry offset */
@@ -2457,6 +2951,7 @@ static int add_dot_entries(DOS_FS *fs, DOS_FILE *parent, int dots)
 
     file->offset = start_offset + offset;
     fs_write(file->offset, ent_size, de);
+    set_dos_ent(&file->dir_ent, de);
 
     if (dots == DOT_ENTRY) {
         MODIFY_START(file, start_clus, fs);
@@ -2482,6 +2977,7 @@ static int check_dots(DOS_FS *fs, DOS_FILE *parent, int dots)
     char *entry_name;
     DOS_FILE file;
     DOS_FILE *dot_file;
+    DIR_ENT dent, p_dent;
     DIR_ENT *p_de;
     DIR_ENT *de;
 
@@ -2509,10 +3005,12 @@ static int check_dots(DOS_FS *fs, DOS_FILE *parent, int dots)
     memset(dot_file, 0, sizeof(DOS_FILE));
     dot_file->parent = parent;
     dot_file->offset = cluster_start(fs, clus_num) + offset;
-    fs_read(dot_file->offset, sizeof(DIR_ENT), &dot_file->dir_ent);
+    fs_read(dot_file->offset, sizeof(DIR_ENT), &dent);
+    set_dos_ent(&dot_file->dir_ent, &dent);
 
-    p_de = &parent->dir_ent;
-    de = &dot_file->dir_ent;
+    p_de = &p_dent;
+    de = &dent;
+    get_dir_ent(parent, p_de);
     if (strncmp((char *)de->name, entry_name, LEN_FILE_NAME) == 0) {
         if (list)
             printf("Checking file %s\n", path_name(dot_file));
@@ -2604,7 +3102,7 @@ static int check_dots(DOS_FS *fs, DOS_FILE *parent, int dots)
                 de->time = p_de->time;
                 de->date = p_de->date;
                 de->size = 0;
-                fs_write(dot_file->offset, sizeof(dot_file->dir_ent), de);
+                fs_write(dot_file->offset, sizeof(DIR_ENT), de);
                 MODIFY_START(dot_file, start_clus, fs);
                 break;
             }
@@ -2732,6 +3230,8 @@ void clean_dirty_flag(DOS_FS *fs)
 
         switch (interactive ? get_key("12", "?") : '1') {
             case '1':
+                /* repairs should be durable before the flag is cleaned */
+                fs_barrier();
                 if (fs->fat_state & FAT_STATE_DIRTY) {
                     vi->state &= ~FAT_STATE_DIRTY;
                     fs_write_immed(0, sizeof(b), &b);
@@ -2752,17 +3252,17 @@ void clean_dirty_flag(DOS_FS *fs)
 }
 
 static DOS_FILE *__get_owner_subdir(DOS_FS *fs, DOS_FILE *parent,
-        uint32_t cluster)
+        DOS_FILE *file, uint32_t cluster)
 {
     DOS_FILE *walk = NULL;
     DOS_FILE *owner = NULL;
 
     for (walk = parent->first; walk; walk = walk->next) {
-        if (check_file_owner(fs, walk, cluster, -1))
+        if (walk != file && check_file_owner(fs, walk, cluster, -1))
             return walk;
 
         if (IS_DIR(walk->dir_ent.attr)) {
-            owner = __get_owner_subdir(fs, walk, cluster);
+            owner = __get_owner_subdir(fs, walk, file, cluster);
             if (owner)
                 return owner;
         }
@@ -2801,18 +3301,19 @@ static int check_file_owner(DOS_FS *fs, DOS_FILE *walk, uint32_t cluster, int cn
 
 }
 
-static DOS_FILE *find_owner(DOS_FS *fs, uint32_t cluster)
+/* find a file other than 'file' which has 'cluster' in its chain */
+static DOS_FILE *find_owner(DOS_FS *fs, DOS_FILE *file, uint32_t cluster)
 {
     DOS_FILE *walk = NULL;
     DOS_FILE *owner = NULL;
 
     for (walk = fs->root_cluster ? root->first : root;
             walk; walk = walk->next) {
-        if (check_file_owner(fs, walk, cluster, -1))
+        if (walk != file && check_file_owner(fs, walk, cluster, -1))
             return walk;
 
         if (IS_DIR(walk->dir_ent.attr)) {
-            owner = __get_owner_subdir(fs, walk, cluster);
+            owner = __get_owner_subdir(fs, walk, file, cluster);
             if (owner)
                 return owner;
         }
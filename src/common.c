@@ -22,10 +22,15 @@
 unsigned long max_alloc = 0;
 unsigned long total_alloc = 0;
 
-typedef struct _link {
-    void *data;
-    struct _link *next;
-} LINK;
+/* header of slab, data follows it at ARENA_ALIGN */
+typedef struct arena_slab {
+    struct arena_slab *next;
+    unsigned long size;     /* bytes of data */
+    unsigned long used;
+} ARENA_SLAB;
+
+#define SLAB_HDR_SIZE   ROUND_TO_MULTIPLE(sizeof(ARENA_SLAB), ARENA_ALIGN)
+#define SLAB_DATA(s)    ((char *)(s) + SLAB_HDR_SIZE)
 
 void die(char *msg,...)
 {
@@ -52,13 +57,28 @@ void pdie(char *msg,...)
 void *alloc_mem(int size)
 {
     void *this;
+    unsigned long total;
+#ifdef __GNUC__
+    unsigned long peak;
+#endif
 
     if ((this = malloc(size))) {
         memset(this, 0, size);
 
-        total_alloc += size;
-        if (total_alloc > max_alloc)
-            max_alloc = total_alloc;
+        /* Usable size is counted, as free_mem() only knows that, so totals
+         * are bigger than requested sizes. Threads reading FAT may allocate,
+         * so both total and peak are updated atomically. */
+#ifdef __GNUC__
+        total = __sync_add_and_fetch(&total_alloc, malloc_usable_size(this));
+        peak = max_alloc;
+        while (total > peak &&
+                !__sync_bool_compare_and_swap(&max_alloc, peak, total))
+            peak = max_alloc;
+#else
+        total = total_alloc += size;
+        if (total > max_alloc)
+            max_alloc = total;
+#endif
 
         return this;
     }
@@ -73,34 +93,81 @@ void free_mem(void *p)
         return;
 
 #ifdef __GNUC__
-    total_alloc -= malloc_usable_size(p);
+    __sync_sub_and_fetch(&total_alloc, malloc_usable_size(p));
 #endif
     free(p);
 }
 
-void *qalloc(void **root, int size)
+static ARENA_SLAB *alloc_slab(ARENA *arena, unsigned long size)
+{
+    ARENA_SLAB *slab;
+
+    slab = alloc_mem(SLAB_HDR_SIZE + size);
+    slab->size = size;
+    arena->size += SLAB_HDR_SIZE + size;
+    return slab;
+}
+
+void *qalloc(ARENA *arena, int size)
 {
-    LINK *link;
+    ARENA_SLAB *slab;
+    unsigned long need = ROUND_TO_MULTIPLE(size, ARENA_ALIGN);
+    void *p;
+
+    arena->used += need;
+    if (arena->used > arena->max_used)
+        arena->max_used = arena->used;
+
+    /* large area has its own slab, which is freed on reset */
+    if (need > ARENA_SLAB_SIZE / 4) {
+        slab = alloc_slab(arena, need);
+        slab->next = arena->big;
+        arena->big = slab;
+        return SLAB_DATA(slab);
+    }
+
+    /* move to next slab kept from previous pass, or add new one */
+    while (!arena->cur || arena->cur->used + need > arena->cur->size) {
+        if (arena->cur && arena->cur->next) {
+            arena->cur = arena->cur->next;
+            arena->cur->used = 0;
+            continue;
+        }
 
-    link = alloc_mem(sizeof(LINK));
-    link->next = *root;
-    *root = link;
-    return link->data = alloc_mem(size);
+        slab = alloc_slab(arena, ARENA_SLAB_SIZE);
+        if (arena->cur)
+            arena->cur->next = slab;
+        else
+            arena->head = slab;
+        arena->cur = slab;
+    }
+
+    p = SLAB_DATA(arena->cur) + arena->cur->used;
+    arena->cur->used += need;
+    memset(p, 0, size);
+    return p;
 }
 
-void qfree(void **root)
+void qfree(ARENA *arena)
 {
-    LINK *this;
+    ARENA_SLAB *slab;
 
-    while (*root) {
-        this = (LINK *) *root;
-        *root = this->next;
-        free_mem(this->data);
-        free_mem(this);
+    while ((slab = arena->big)) {
+        arena->big = slab->next;
+        arena->size -= SLAB_HDR_SIZE + slab->size;
+        free_mem(slab);
     }
 
-    max_alloc = 0;
-    total_alloc = 0;
+    arena->cur = arena->head;
+    if (arena->cur)
+        arena->cur->used = 0;
+    arena->used = 0;
+}
+
+void print_arena(ARENA *arena)
+{
+    printf("Arena allocated memory is %lu Bytes, at most %lu Bytes used\n",
+            arena->size, arena->max_used);
 }
 
 int min(int a, int b)
@@ -113,6 +180,38 @@ int max(int a, int b)
     return a < b ? b : a;
 }
 
+long long parse_size(char *str)
+{
+    long long size;
+    char *end;
+
+    errno = 0;
+    size = strtoll(str, &end, 0);
+    if (errno || end == str || size < 0)
+        return -1;
+
+    switch (*end) {
+        case 'G':
+        case 'g':
+            size <<= 10;
+            /* fall through */
+        case 'M':
+        case 'm':
+            size <<= 10;
+            /* fall through */
+        case 'K':
+        case 'k':
+            size <<= 10;
+            end++;
+            break;
+    }
+
+    if (*end)
+        return -1;
+
+    return size;
+}
+
 char get_key(char *valid, char *prompt)
 {
     int ch, okay;
@@ -199,6 +298,101 @@ int test_bit(unsigned int nr, unsigned long *addr)
     return 1UL & (addr[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1)));
 }
 
+/* mask of bits from 'nr' to the end of word, limited to 'end' bit */
+static inline unsigned long range_mask(unsigned int nr, unsigned int end)
+{
+    unsigned long mask = ~0UL << (nr % BITS_PER_LONG);
+
+    if (BIT_WORD(nr) == BIT_WORD(end - 1))
+        mask &= ~0UL >> (BITS_PER_LONG - 1 - (end - 1) % BITS_PER_LONG);
+    return mask;
+}
+
+/* set 'cnt' bits from 'nr' a word at a time */
+void set_bits(unsigned int nr, unsigned int cnt, unsigned long *addr)
+{
+    unsigned int end = nr + cnt;
+
+    while (nr < end) {
+        addr[BIT_WORD(nr)] |= range_mask(nr, end);
+        nr = (BIT_WORD(nr) + 1) * BITS_PER_LONG;
+    }
+}
+
+void clear_bits(unsigned int nr, unsigned int cnt, unsigned long *addr)
+{
+    unsigned int end = nr + cnt;
+
+    while (nr < end) {
+        addr[BIT_WORD(nr)] &= ~range_mask(nr, end);
+        nr = (BIT_WORD(nr) + 1) * BITS_PER_LONG;
+    }
+}
+
+/* returns the number of set bits among 'cnt' bits from 'nr' */
+unsigned int count_bits(unsigned int nr, unsigned int cnt, unsigned long *addr)
+{
+    unsigned int end = nr + cnt;
+    unsigned int weight = 0;
+
+    while (nr < end) {
+        weight += __builtin_popcountl(addr[BIT_WORD(nr)] & range_mask(nr, end));
+        nr = (BIT_WORD(nr) + 1) * BITS_PER_LONG;
+    }
+
+    return weight;
+}
+
+/* returns the first set bit from 'nr' before 'end', 'end' if there is none */
+unsigned int find_next_bit(unsigned int nr, unsigned int end,
+        unsigned long *addr)
+{
+    unsigned long word;
+
+    while (nr < end) {
+        word = addr[BIT_WORD(nr)] & range_mask(nr, end);
+        if (word)
+            return BIT_WORD(nr) * BITS_PER_LONG + __builtin_ctzl(word);
+        nr = (BIT_WORD(nr) + 1) * BITS_PER_LONG;
+    }
+
+    return end;
+}
+
+/* returns the first clear bit from 'nr' before 'end', 'end' if there is none */
+unsigned int find_next_zero_bit(unsigned int nr, unsigned int end,
+        unsigned long *addr)
+{
+    unsigned long word;
+
+    while (nr < end) {
+        word = ~addr[BIT_WORD(nr)] & range_mask(nr, end);
+        if (word)
+            return BIT_WORD(nr) * BITS_PER_LONG + __builtin_ctzl(word);
+        nr = (BIT_WORD(nr) + 1) * BITS_PER_LONG;
+    }
+
+    return end;
+}
+
+/* dst ^= src over 'words' words */
+void xor_bitmap(unsigned long *dst, unsigned long *src, unsigned int words)
+{
+    unsigned int i;
+
+    for (i = 0; i < words; i++)
+        dst[i] ^= src[i];
+}
+
+/* dst &= ~src over 'words' words */
+void andnot_bitmap(unsigned long *dst, unsigned long *src, unsigned int words)
+{
+    unsigned int i;
+
+    for (i = 0; i < words; i++)
+        dst[i] &= ~src[i];
+}
+
 void print_mem(void)
 {
     unsigned long hmem;
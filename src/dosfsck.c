@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <signal.h>
@@ -21,6 +22,7 @@
 #include "common.h"
 #include "dosfsck.h"
 #include "io.h"
+#include "iodev.h"
 #include "boot.h"
 #include "fat.h"
 #include "file.h"
@@ -31,22 +33,33 @@ int check_dirty_only = 0;
 int atari_format = 0;
 int remain_dirty = 0;
 unsigned n_files = 0;
-void *mem_queue = NULL;
+ARENA mem_queue;
 
 uint32_t max_clus_num;
 
 static void usage(char *name)
 {
-    fprintf(stderr, "usage: %s [-aAflrtvVwy] [-d path -d ...] "
+    fprintf(stderr, "usage: %s [-aAeFflrtvVwy] [-B size] [-c size] [-I backend] [-j jobs] [-J path] [-m size] [-M size] [-s size] [-S dir] [-d path -d ...] "
             "[-u path -u ...]\n%15sdevice\n", name, "");
     fprintf(stderr, "  -a       automatically repair the file system\n");
     fprintf(stderr, "  -A       toggle Atari file system format\n");
+    fprintf(stderr, "  -B size  size limit of flat cluster bitmap (K, M, G suffix)\n");
+    fprintf(stderr, "  -c size  size of read cache (K, M, G suffix), 0 disables it\n");
     fprintf(stderr, "  -C       only check filesystem dirty flag(FAT32/16 only)\n");
     fprintf(stderr, "  -d path  drop that file\n");
+    fprintf(stderr, "  -e       choose differing FAT entries one by one\n");
+    fprintf(stderr, "  -F       check all FATs even if FAT32 mirroring is disabled\n");
     fprintf(stderr, "  -f       salvage unused chains to files\n");
+    fprintf(stderr, "  -I backend  I/O backend: fd, mem, uring or fault[:options]\n");
+    fprintf(stderr, "  -j jobs  number of threads reading FAT\n");
+    fprintf(stderr, "  -J path  journal of changes, replayed if writing was interrupted\n");
     fprintf(stderr, "  -l       list path names\n");
+    fprintf(stderr, "  -m size  size of FAT cache for FAT32 (K, M, G suffix)\n");
+    fprintf(stderr, "  -M size  size limit of cluster owner map (K, M, G suffix), 0 by default\n");
     fprintf(stderr, "  -n       no-op, check non-interactively without changing\n");
     fprintf(stderr, "  -r       interactively repair the file system\n");
+    fprintf(stderr, "  -s size  memory of changes not yet written (K, M, G suffix)\n");
+    fprintf(stderr, "  -S dir   directory of scratch file for changes\n");
     fprintf(stderr, "  -t       test for bad clusters\n");
     fprintf(stderr, "  -u path  try to undelete that (non-directory) file\n");
     fprintf(stderr, "  -v       verbose mode\n");
@@ -76,13 +89,37 @@ static int setup_signal(void)
     return 0;
 }
 
+/* Changes of interrupted repair are written again, only the dirty flag is
+ * left to be cleaned. Nothing else is checked or repaired. */
+static int finish_replay(DOS_FS *fs, int clean)
+{
+    read_boot(fs);
+    /* repairs of boot sector found there are left to a full check */
+    fs_flush(0);
+
+    if (clean) {
+        read_fat_head(fs);
+        clean_dirty_flag(fs);
+    }
+
+    clean_boot(fs);
+    free_fat_cache(fs);
+    fs_flush(1);
+    fs_close();
+
+    return clean ? EXIT_CORRECTED : EXIT_ERRORS_LEFT;
+}
+
 int main(int argc, char **argv)
 {
     DOS_FS fs;
     int rw, salvage_files, verify, c;
     int ret = 0;
+    int replay;
     int dirty_flag = 0;
     uint32_t free_clusters;
+    long long size;
+    char *end;
 
     salvage_files = verify = 0;
     rw = 1;
@@ -91,7 +128,7 @@ int main(int argc, char **argv)
 
     setup_signal();
 
-    while ((c = getopt(argc, argv, "AaCd:flnrtu:vVwy")) != EOF) {
+    while ((c = getopt(argc, argv, "AaB:Cc:d:eFfI:j:J:lm:M:nrs:S:tu:vVwy")) != EOF) {
         switch (c) {
             case 'A': /* toggle Atari format */
                 atari_format = !atari_format;
@@ -102,6 +139,22 @@ int main(int argc, char **argv)
                 interactive = 0;
                 salvage_files = 1;
                 break;
+            case 'B':
+                size = parse_size(optarg);
+                if (size < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_SYNTAX_ERROR);
+                }
+                set_bitmap_flat_size(size);
+                break;
+            case 'c':
+                size = parse_size(optarg);
+                if (size < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_SYNTAX_ERROR);
+                }
+                fs_set_cache_size(size);
+                break;
             case 'C':
                 check_dirty_only = 1;
                 interactive = 0;
@@ -109,12 +162,52 @@ int main(int argc, char **argv)
             case 'd':
                 file_add(optarg, fdt_drop);
                 break;
+            case 'e':
+                set_fat_select(FAT_ENTRY);
+                break;
+            case 'F':
+                set_all_fats(1);
+                break;
             case 'f':
                 salvage_files = 1;
                 break;
+            case 'I':
+                if (!io_find_backend(optarg)) {
+                    usage(argv[0]);
+                    exit(EXIT_SYNTAX_ERROR);
+                }
+                fs_set_backend(optarg);
+                break;
+            case 'j':
+                size = strtoll(optarg, &end, 10);
+                if (*end || size < 1 || size > MAX_FAT_JOBS) {
+                    usage(argv[0]);
+                    exit(EXIT_SYNTAX_ERROR);
+                }
+                set_fat_jobs(size);
+                break;
+            case 'J':
+                fs_set_journal(optarg);
+                break;
             case 'l':
                 list = 1;
                 break;
+            case 'm':
+                size = parse_size(optarg);
+                if (size < 0 || size / FAT_CACHE_SIZE > INT_MAX) {
+                    usage(argv[0]);
+                    exit(EXIT_SYNTAX_ERROR);
+                }
+                set_fat_cache_size(size);
+                break;
+            case 'M':
+                size = parse_size(optarg);
+                if (size < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_SYNTAX_ERROR);
+                }
+                set_owner_map_size(size);
+                break;
             case 'n':
                 rw = 0;
                 interactive = 0;
@@ -123,6 +216,17 @@ int main(int argc, char **argv)
                 rw = 1;
                 interactive = 1;
                 break;
+            case 's':
+                size = parse_size(optarg);
+                if (size < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_SYNTAX_ERROR);
+                }
+                fs_set_change_limit(size);
+                break;
+            case 'S':
+                fs_set_scratch_dir(optarg);
+                break;
             case 't':
                 test = 1;
                 break;
@@ -156,6 +260,9 @@ int main(int argc, char **argv)
 
     printf("dosfsck " VERSION ", " VERSION_DATE ", FAT32, LFN\n");
     fs_open(argv[optind], rw);
+    replay = rw ? fs_replay_journal() : -1;
+    if (replay >= 0)
+        return finish_replay(&fs, replay);
     read_boot(&fs);
 
     if (verify)
@@ -204,6 +311,9 @@ int main(int argc, char **argv)
 
     if (verbose) {
         print_mem();
+        print_arena(&mem_queue);
+        fs_print_cache();
+        print_fat_cache(&fs);
 #ifdef DEBUG
         print_changes();
 #endif
@@ -217,12 +327,15 @@ int main(int argc, char **argv)
         scan_root(&fs);
         check_volume_label(&fs);
         reclaim_free(&fs);
-        if (verbose)
+        if (verbose) {
             print_mem();
+            print_arena(&mem_queue);
+        }
 
         qfree(&mem_queue);
     }
 
+    flush_fat(&fs);
     if (fs_changed()) {
         if (rw) {
             if (interactive)
@@ -245,12 +358,13 @@ int main(int argc, char **argv)
     if (!remain_dirty && rw)
         clean_dirty_flag(&fs);
 
-    if (fs.fat_cache.addr) {
-        fs_munmap(fs.fat_cache.addr, FAT_CACHE_SIZE);
-    }
+    free_fat_cache(&fs);
+    free_cluster_bitmaps(&fs);
 
     /* sync for dirty flag */
     fs_flush(rw);
+    if (verbose)
+        fs_print_flush();
 
     fs_close();
     if (remain_dirty)
@@ -17,6 +17,7 @@
 
 #include "common.h"
 #include "dosfs.h"
+#include "iodev.h"
 
 #define DUMP_FILENAME   "./dump.file"
 
@@ -34,14 +35,16 @@ typedef enum dflag {
 extern int errno;
 
 DOS_FS fs;
-int fd_in;
+IO_DEV *dev_in;
+char *backend = IO_DEFAULT_BACKEND;
 int fd_out;
 int fd_out_stdout = 0;
 loff_t stdout_offset = (off_t)-1;
 
 int verbose = 0;
-int fat_num = 0;
+int fat_num = -1;   /* active FAT if mirroring is disabled, first FAT if not */
 int atari_format = 0;
+unsigned int device_no;
 dflag_t dump_flag = DUMP_META;
 unsigned short reserved_cnt;
 unsigned short sector_size;
@@ -51,57 +54,11 @@ uint32_t max_clus_num;  /* Not used, for removing compile error */
 char *buf_clus = NULL;
 char *buf_sec = NULL;
 char outfile[256];
-char *write_bitmap = NULL;
+unsigned long *write_bitmap = NULL;
+loff_t fat_offset;  /* start of the FAT to traverse cluster chain */
 
 static void traverse_tree(DOS_FS *fs, uint32_t clus_num, int attr);
 
-static inline int bitmap_get(char *bitmap, unsigned int i)
-{
-    unsigned int index, offset;
-
-    index = i / BITS_PER_BYTE;
-    offset = i % BITS_PER_BYTE;
-    return (bitmap[index] & (1 << offset)) ? 1 : 0;
-}
-
-static inline void bitmap_set(char *bitmap, unsigned int i)
-{
-    unsigned int index, offset;
-
-    index = i / BITS_PER_BYTE;
-    offset = i % BITS_PER_BYTE;
-    bitmap[index] |= (1 << offset);
-}
-
-static int bitmap_set_range(char *bitmap, unsigned int s, unsigned int e)
-{
-    if (s > e)
-        return -EINVAL;
-
-    while (s <= e) {
-        bitmap_set(bitmap, s);
-        s++;
-    }
-    return 0;
-}
-
-static int bitmap_find_next_one(char *bitmap,
-        unsigned int s, unsigned int e_excl,
-        unsigned int *next)
-{
-    if (s >= e_excl)
-        return -EINVAL;
-
-    while (s < e_excl) {
-        if (bitmap_get(bitmap, s)) {
-            *next = s;
-            return 0;
-        }
-        s++;
-    }
-    return 1;
-}
-
 static void zero_out_region_stdout(off_t end_excl)
 {
     size_t len;
@@ -131,8 +88,8 @@ static inline void dump__get_fat(DOS_FS *fs, uint32_t cluster, uint32_t *value)
             unsigned char data[2] = {0, };
 
             clus_size = 2;
-            offset = fs->fat_start + cluster * 3 / 2;
-            if (pread(fd_in, data, clus_size, offset) < 0)
+            offset = fat_offset + cluster * 3 / 2;
+            if (io_pread(dev_in, data, clus_size, offset) < 0)
                 pdie("Read %d bytes at %lld(%d,%s)", clus_size, offset, __LINE__, __func__);
 
             *value = 0xfff & (cluster & 1 ? (data[0] >> 4) | (data[1] << 4) :
@@ -143,8 +100,8 @@ static inline void dump__get_fat(DOS_FS *fs, uint32_t cluster, uint32_t *value)
             unsigned short data = 0;
 
             clus_size = 2;
-            offset = fs->fat_start + cluster * clus_size;
-            if (pread(fd_in, (void *)&data, clus_size, offset) < 0)
+            offset = fat_offset + cluster * clus_size;
+            if (io_pread(dev_in, (void *)&data, clus_size, offset) < 0)
                 pdie("Read %d bytes at %lld(%d,%s)", clus_size, offset, __LINE__, __func__);
 
             *value = CF_LE_W(data);
@@ -154,8 +111,8 @@ static inline void dump__get_fat(DOS_FS *fs, uint32_t cluster, uint32_t *value)
             uint32_t data = 0;
 
             clus_size = 4;
-            offset = fs->fat_start + cluster * clus_size;
-            if (pread(fd_in, (void *)&data, clus_size, offset) < 0)
+            offset = fat_offset + cluster * clus_size;
+            if (io_pread(dev_in, (void *)&data, clus_size, offset) < 0)
                 pdie("Read %d bytes at %lld(%d,%s)", clus_size, offset, __LINE__, __func__);
 
             /* According to MS, the high 4 bits of a FAT32 entry are reserved and
@@ -194,11 +151,11 @@ static void dump_area(loff_t pos, int size, void *data)
         unsigned int s, e;
         s = (pos - fs.root_start) / fs.cluster_size;
         e = (pos + size - 1 - fs.root_start) / fs.cluster_size;
-        bitmap_set_range(write_bitmap, s, e);
+        set_bits(s, e - s + 1, write_bitmap);
         return;
     }
 
-    if ((ret = pread(fd_in, data, size, pos)) < 0)
+    if ((ret = io_pread(dev_in, data, size, pos)) < 0)
         pdie("Read %d bytes at %lld", size, pos);
 
     if (ret != size)
@@ -214,26 +171,14 @@ static void dump_area(loff_t pos, int size, void *data)
 static void dump_orphaned(DOS_FS *fs)
 {
     loff_t clus_offset;
-    int i;
+    uint32_t i;
     uint32_t next_clus;
 
     /* check fat entry that is not zero */
+    bitmap_xor(fs->real_bitmap, fs->bitmap);
 
-    for (i = 0; i < (fs->bitmap_size / sizeof(long)); i++) {
-        fs->real_bitmap[i] ^= fs->bitmap[i];
-    }
-
-    for (i = FAT_START_ENT; i < fs->clusters + FAT_START_ENT; i++) {
-
-        if (i % BITS_PER_LONG == 0 && fs->real_bitmap[i / BITS_PER_LONG] == 0) {
-            i = ((i / BITS_PER_LONG) * BITS_PER_LONG) + BITS_PER_LONG - 1;
-            continue;
-        }
-
-        if (!test_bit(i, fs->real_bitmap)) {
-            continue;
-        }
-
+    for_each_bitmap_set(i, FAT_START_ENT, fs->clusters + FAT_START_ENT,
+            fs->real_bitmap) {
         dump__get_fat(fs, i, &next_clus);
         if (next_clus && next_clus < fs->clusters + FAT_START_ENT) {
             clus_offset = dump__cluster_start(fs, next_clus);
@@ -250,9 +195,9 @@ static void __traverse_file(DOS_FS *fs, uint32_t clus_num)
     cluster = clus_num;
 
     do {
-        if (test_bit(cluster, fs->real_bitmap))
+        if (bitmap_test_bit(fs->real_bitmap, cluster))
             break;
-        set_bit(cluster, fs->real_bitmap);
+        bitmap_set_bit(fs->real_bitmap, cluster);
 
         clus_offset = dump__cluster_start(fs, cluster);
         dump_area(clus_offset, fs->cluster_size, buf_clus);
@@ -270,7 +215,7 @@ static void __traverse_dir(DOS_FS *fs, uint32_t clus_num)
     int offset = 0;
     uint32_t sub_clus;
 
-    set_bit(clus_num, fs->real_bitmap);
+    bitmap_set_bit(fs->real_bitmap, clus_num);
 
     /* clus_num parameter is valid, already checked before being called */
     clus_offset = dump__cluster_start(fs, clus_num);
@@ -278,7 +223,7 @@ static void __traverse_dir(DOS_FS *fs, uint32_t clus_num)
 
     while (clus_num > 0 && clus_num < fs->clusters + FAT_START_ENT) {
 
-        if (pread(fd_in, &de, sizeof(DIR_ENT), clus_offset + offset) < 0)
+        if (io_pread(dev_in, &de, sizeof(DIR_ENT), clus_offset + offset) < 0)
             pdie("Read %d bytes at %lld(%d,%s)",
                     sizeof(DIR_ENT), clus_offset, __LINE__, __func__);
 
@@ -290,9 +235,9 @@ static void __traverse_dir(DOS_FS *fs, uint32_t clus_num)
             }
 
             offset = 0;
-            if (test_bit(clus_num, fs->real_bitmap))
+            if (bitmap_test_bit(fs->real_bitmap, clus_num))
                 continue;
-            set_bit(clus_num, fs->real_bitmap);
+            bitmap_set_bit(fs->real_bitmap, clus_num);
 
             clus_offset = dump__cluster_start(fs, clus_num);
             dump_area(clus_offset, fs->cluster_size, buf_clus);
@@ -355,7 +300,7 @@ static void dump_data(DOS_FS *fs)
         dump_area(clus_offset, fs->cluster_size, buf_clus);
 
         for (i = 0; i < fs->root_entries; i++) {
-            if (pread(fd_in, &de, sizeof(DIR_ENT),
+            if (io_pread(dev_in, &de, sizeof(DIR_ENT),
                         clus_offset + i * sizeof(DIR_ENT)) < 0) {
                 pdie("Read %d bytes at %lld(%d,%s)", sizeof(DIR_ENT),
                         clus_offset + i * sizeof(DIR_ENT), __LINE__, __func__);
@@ -383,7 +328,7 @@ static void dump_cluster_stdout(unsigned int clu)
 
     src_offset = fs.root_start + (off_t)clu * fs.cluster_size;
 
-    if (pread(fd_in, buf_clus, fs.cluster_size, src_offset) !=
+    if (io_pread(dev_in, buf_clus, fs.cluster_size, src_offset) !=
             (ssize_t)fs.cluster_size)
         pdie("Read %u bytes at %lld(%d,%s)", fs.cluster_size,
                 src_offset , __LINE__, __func__);
@@ -405,14 +350,15 @@ static void dump_data_stdout(DOS_FS *fs)
     last_i = fs->bitmap_size * 8;
     while (i < last_i) {
         /* read clusters and write these for allocated clusters */
-        while (i < last_i && bitmap_get(write_bitmap, i)) {
+        next_i = find_next_zero_bit(i, last_i, write_bitmap);
+        while (i < next_i) {
             dump_cluster_stdout(i);
             i++;
         }
 
         /* not write zeroes if all of remaining clusters are free */
-        if (bitmap_find_next_one(write_bitmap,
-                    i, last_i, &next_i))
+        next_i = find_next_bit(i, last_i, write_bitmap);
+        if (next_i == last_i)
             break;
 
         /* write zeroes for the free clusters */
@@ -452,17 +398,18 @@ static void dump__read_fat(DOS_FS *fs)
     remain_size = fat_size;
 
     start_offset = fs->fat_start;
-    if (fat_num && fat_num < fs->nfats) {
-        start_offset = fs->fat_start + fs->fat_size * fat_num;
+    if (fat_num > 0 && fat_num < fs->nfats) {
+        start_offset = fs->fat_start + (loff_t)fs->fat_size * fat_num;
     }
+    fat_offset = start_offset;
 
-    fs->bitmap = alloc_mem(fs->bitmap_size);
-    fs->real_bitmap = alloc_mem(fs->bitmap_size);
+    fs->bitmap = alloc_bitmap(fs->clusters + FAT_START_ENT, FALSE);
+    fs->real_bitmap = alloc_bitmap(fs->clusters + FAT_START_ENT, FALSE);
 
     while (remain_size > 0) {
         int i;
 
-        if (pread(fd_in, fat, read_size, start_offset + offset) < 0)
+        if (io_pread(dev_in, fat, read_size, start_offset + offset) < 0)
             pdie("Read %d bytes at %lld(%d,%s)",
                     read_size, start_offset + offset, __LINE__, __func__);
 
@@ -484,7 +431,7 @@ static void dump__read_fat(DOS_FS *fs)
             }
 
             /* set bitmap only valid cluster */
-            set_bit(total_cluster + i, fs->bitmap);
+            bitmap_set_bit(fs->bitmap, total_cluster + i);
         }
 
         start = 0;
@@ -499,11 +446,9 @@ static void dump__read_fat(DOS_FS *fs)
 
 static void dump_fats(DOS_FS *fs)
 {
+    loff_t pos = fs->fat_start;
     int i, j;
 
-    if (lseek(fd_in, fs->fat_start, SEEK_SET) != fs->fat_start)
-        pdie("Seek to %lld of input(%d,%s)", fs->fat_start, __LINE__, __func__);
-
     if (fd_out_stdout == 0) {
         if (lseek(fd_out, fs->fat_start, SEEK_SET) != fs->fat_start)
             pdie("Seek to %lld of input(%d,%s)", fs->fat_start, __LINE__, __func__);
@@ -514,8 +459,9 @@ static void dump_fats(DOS_FS *fs)
 
     for (i = 0; i < fs->nfats; i++) {
         for (j = 0; j < sec_per_fat; j++) {
-            if (read(fd_in, buf_sec, sector_size) < 0)
+            if (io_pread(dev_in, buf_sec, sector_size, pos) < 0)
                 pdie("Read FAT(%d,%s)", __LINE__, __func__);
+            pos += sector_size;
 
             if (write(fd_out, buf_sec, sector_size) < 0)
                 pdie("Write FAT(%d,%s)", __LINE__, __func__);
@@ -531,9 +477,6 @@ static void dump_reserved(DOS_FS *fs)
 {
     int i;
 
-    if (lseek(fd_in, 0, SEEK_SET) != 0)
-        pdie("Seek to %lld of input(%d,%s)", 0, __LINE__, __func__);
-
     if (fd_out_stdout == 0) {
         if (lseek(fd_out, 0, SEEK_SET) != 0)
             pdie("Seek to %lld of input(%d,%s)", 0, __LINE__, __func__);
@@ -543,7 +486,8 @@ static void dump_reserved(DOS_FS *fs)
     }
 
     for (i = 0; i < reserved_cnt; i++) {
-        if (read(fd_in, buf_sec, sector_size) < 0)
+        if (io_pread(dev_in, buf_sec, sector_size,
+                    (loff_t)i * sector_size) < 0)
             pdie("Read reserved sector(%d,%s)", __LINE__, __func__);
 
         if (write(fd_out, buf_sec, sector_size) < 0)
@@ -578,13 +522,12 @@ static int dump__read_boot(DOS_FS *fs, struct boot_sector *b)
     off_t data_size;
     off_t last_offset;
     off_t device_size;
-    off_t ret = 0;
     int change_flag = 0;
 
     /* read device size */
-    device_size = lseek(fd_in, 0, SEEK_END);
+    device_size = io_size(dev_in);
     if (device_size < 0) {
-        fprintf(stderr, "lseek error (%s)\n", strerror(errno));
+        fprintf(stderr, "size error (%s)\n", strerror(errno));
         exit(-1);
     }
 
@@ -600,7 +543,7 @@ static int dump__read_boot(DOS_FS *fs, struct boot_sector *b)
     };
 
     /* read boot_sector */
-    if (pread(fd_in, b, sizeof(struct boot_sector), 0) < 0)
+    if (io_pread(dev_in, b, sizeof(struct boot_sector), 0) < 0)
         pdie("Read %d bytes at %lld(%d,%s)",
                 sizeof(struct boot_sector), 0, __LINE__, __func__);
 
@@ -643,8 +586,7 @@ retry:
 
     /* Can't access last odd sector anyway, so round down */
     last_offset = (off_t)((total_sectors & ~0x01) - 1) * (off_t)sector_size;
-    ret = lseek(fd_in, last_offset, SEEK_SET);
-    if (ret != last_offset) {
+    if (last_offset < 0 || last_offset + sector_size > device_size) {
         /* Can't dump all blocks, just dump reserved and FAT only */
         dump_flag = DUMP_FAT;
     }
@@ -674,6 +616,10 @@ retry:
         }
 
         fs->backupboot_start = CF_LE_W(b->fat32.backup_boot) * sector_size;
+
+        /* only active FAT is up to date if mirroring is disabled */
+        if (fat_num < 0 && (CF_LE_W(b->fat32.flags) & FAT32_NO_MIRROR))
+            fat_num = CF_LE_W(b->fat32.flags) & FAT32_ACTIVE_FAT;
         /* TODO: if main boot sector is corrupted, use backup boot */
     }
     else if (!atari_format) {
@@ -682,14 +628,6 @@ retry:
         fs->fat_bits = (fs->clusters > MSDOS_FAT12) ? 16 : 12;
     }
     else {
-        unsigned int device_no;
-        struct stat st;
-
-        if (fstat(fd_in, &st) < 0)
-            pdie("fstat error");
-
-        device_no = S_ISBLK(st.st_mode) ? (st.st_rdev >> 8) & 0xff : 0;
-
         /* On Atari, things are more difficult: GEMDOS always uses 12bit FATs
          * on floppies, and always 16 bit on harddisks. */
         fs->fat_bits = 16; /* assume 16 bit FAT for now */
@@ -737,27 +675,27 @@ retry:
 
 static void usage(char *name)
 {
-    fprintf(stderr, "Usage: %s [-o <output file path>] [-f <fat number>] [-v] [-h] device\n", name);
+    fprintf(stderr, "Usage: %s [-o <output file path>] [-f <fat number>] [-I <backend>] [-v] [-h] device\n", name);
     fprintf(stderr,
             "  -o <output file path>    help message\n");
     fprintf(stderr,
             "  -f <fat number>          FAT number to traverse cluster chain\n");
+    fprintf(stderr,
+            "  -I <backend>             I/O backend: fd, mem, uring or fault[:options]\n");
     fprintf(stderr, "  -v                       verbose mode\n");
     fprintf(stderr, "  -h                       help message\n");
 }
 
 void clean_dump(DOS_FS *fs)
 {
-    if (fs->bitmap)
-        free_mem(fs->bitmap);
-
-    if (fs->real_bitmap)
-        free_mem(fs->real_bitmap);
+    free_bitmap(fs->bitmap);
+    free_bitmap(fs->real_bitmap);
 }
 
 int main(int argc, char *argv[])
 {
     struct boot_sector b;
+    struct stat st;
     int c;
     int ret = 0;
 
@@ -765,12 +703,19 @@ int main(int argc, char *argv[])
 
     memset(outfile, 0, 256);
     memcpy(outfile, DUMP_FILENAME, strlen(DUMP_FILENAME));
-    while ((c = getopt(argc, argv, "f:o:vh")) != EOF) {
+    while ((c = getopt(argc, argv, "f:I:o:vh")) != EOF) {
         switch (c) {
             case 'f':
                 fat_num = atoi(optarg);
                 /* dump data using n-th FAT */
                 break;
+            case 'I':
+                if (!io_find_backend(optarg)) {
+                    usage(argv[0]);
+                    exit(EXIT_SYNTAX_ERROR);
+                }
+                backend = optarg;
+                break;
             case 'o':   /* specify output file */
                 memset(outfile, 0, 255);
                 if (strlen(optarg) > 255) {
@@ -805,11 +750,12 @@ int main(int argc, char *argv[])
         exit(EXIT_SYNTAX_ERROR);
     }
 
-    fd_in = open(argv[optind], O_RDONLY);
-    if (fd_in < 0) {
-        fprintf(stderr, "Can't open device('%s')\n", argv[optind]);
-        exit(EXIT_FAILURE);
-    }
+    dev_in = io_open(backend, argv[optind], O_RDONLY);
+
+    /* kind of device decides FAT size on Atari */
+    if (stat(argv[optind], &st) < 0)
+        pdie("stat %s", argv[optind]);
+    device_no = S_ISBLK(st.st_mode) ? (st.st_rdev >> 8) & 0xff : 0;
 
     if (fd_out_stdout == 0) {
         fd_out = open(outfile, O_RDWR | O_CREAT | O_TRUNC, 0666);
@@ -857,7 +803,8 @@ int main(int argc, char *argv[])
         die("Memory allocation failed(%s,%d)", __func__, __LINE__);
     }
 
-    write_bitmap = alloc_mem(fs.bitmap_size);
+    write_bitmap = alloc_mem(ROUND_TO_MULTIPLE(fs.bitmap_size,
+                sizeof(long)));
 
     dump_data(&fs);
     if (fd_out_stdout)
@@ -873,7 +820,7 @@ int main(int argc, char *argv[])
 
     clean_dump(&fs);
 
-    close(fd_in);
+    io_close(dev_in);
     if (fd_out_stdout == 0) {
         fsync(fd_out);
         close(fd_out);
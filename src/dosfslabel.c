@@ -27,7 +27,7 @@
 int interactive = 0, list = 0, test = 0, verbose = 0, write_immed = 0;
 int atari_format = 0;
 unsigned n_files = 0;
-void *mem_queue = NULL;
+ARENA mem_queue;
 
 /* TODO: separate code for not compiling uncessary file */
 int remain_dirty = 0;   /* Not used : for removing compile error */
@@ -48,7 +48,7 @@ int main(int argc, char *argv[])
 {
     DOS_FS fs;
     int rw = 0;
-    int save_nfats = 0;
+    int save_copies = 0;
     int ret = 0;
 
     char *device = NULL;
@@ -81,13 +81,14 @@ int main(int argc, char *argv[])
     fs_open(device, rw);
     read_boot(&fs);
 
-    /* dosfslabel doesn't need second FAT handling in read_fat()
-     * so change fs.nfats to 1 temporarily and
+    /* dosfslabel doesn't need comparing other FATs in read_fat()
+     * so read only first FAT in use and
      * after calling read_fat() restore original value */
-    save_nfats = fs.nfats;
-    fs.nfats = 1;
+    save_copies = fs.fat_copies;
+    fs.fat_copies = 1;
     read_fat(&fs);
-    fs.nfats = save_nfats;
+    flush_fat(&fs);
+    fs.fat_copies = save_copies;
 
     if (!rw) {
         fprintf(stdout, "%s\n", fs.label);
@@ -116,6 +117,7 @@ int main(int argc, char *argv[])
 out:
     clean_boot(&fs);
 
+    flush_fat(&fs);
     ret = fs_flush(rw);
     fs_close();
     return (ret ? EXIT_FAILURE : EXIT_SUCCESS);
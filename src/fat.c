@@ -10,11 +10,16 @@
 
 /* Copyright (c) 2022-2026 LG Electronics Inc. */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "common.h"
 #include "dosfsck.h"
@@ -29,299 +34,1267 @@ uint32_t bad_clusters;
 int __check_file_owner(DOS_FS *fs, uint32_t start, uint32_t cluster, int cnt);
 void set_exclusive_bitmap(DOS_FS *fs)
 {
-    unsigned int i;
-
     /* bitmap : read from disk(FAT)
      * real_bitmap : set by traversing file tree */
 
     /* After exclusive OR operation,
      * real_bitmap represent orphaned clusters and
      * bitmap represent previous real_bitmap which is set by traversing */
-    for (i = 0; i < (fs->bitmap_size / sizeof(long)); i++) {
-        fs->real_bitmap[i] ^= fs->bitmap[i];
-        fs->bitmap[i] ^= fs->real_bitmap[i];
-    }
+    bitmap_xor(fs->real_bitmap, fs->bitmap);
+    bitmap_xor(fs->bitmap, fs->real_bitmap);
 }
 
-static void init_fat_cache(DOS_FS *fs)
+static long long fat_cache_size = FAT_CACHE_SIZE;
+
+void set_fat_cache_size(long long size)
 {
-    loff_t aligned_offset;
+    fat_cache_size = size;
+}
 
-    /* initialize fat cache */
-    fs->fat_cache.start = -1;
+static long long bitmap_flat_size = BITMAP_FLAT_SIZE;
 
-    aligned_offset = fs->fat_start & ~(sysconf(_SC_PAGE_SIZE) - 1);
-    fs->fat_cache.diff = fs->fat_start - aligned_offset;
+void set_bitmap_flat_size(long long size)
+{
+    bitmap_flat_size = size;
+}
 
-    fs->fat_cache.cpc = FAT_CACHE_SIZE / fs->fat_bits * BITS_PER_BYTE;
-    fs->fat_cache.first_cpc =
-        ((FAT_CACHE_SIZE - fs->fat_cache.diff) * BITS_PER_BYTE) / fs->fat_bits;
-    fs->fat_cache.last_cpc =
-        (max_clus_num - fs->fat_cache.first_cpc) % fs->fat_cache.cpc;
+/* Cluster bitmap is compressed if flat one is larger than the limit */
+BITMAP *alloc_cluster_bitmap(DOS_FS *fs)
+{
+    return alloc_bitmap(max_clus_num, fs->bitmap_size > bitmap_flat_size);
+}
 
-    fs->fat_cache.addr = NULL;
+void free_cluster_bitmaps(DOS_FS *fs)
+{
+    free_bitmap(fs->bitmap);
+    free_bitmap(fs->real_bitmap);
+    fs->bitmap = fs->real_bitmap = NULL;
 }
 
-void read_fat(DOS_FS *fs)
+/* FAT cache is a set of mmap windows on the first FAT, replaced by LRU.
+ * Windows stay valid for the next passes, so initialize it only once. */
+static void init_fat_cache(DOS_FS *fs)
 {
-    int fat_size;
-    int read_size;
-    loff_t offset = 0;
-    int remain_size;
-    int bitmap_size;
-    int first_ok;
-    int second_ok;
-    int clus_size;  /* cluster size (bytes) */
-    int cpr;    /* number of cluster per read size */
-    int total_cluster = 0;
-    fat_select_t flag = FAT_NONE;
-    char *first_fat = NULL;
-    char *second_fat = NULL;
-    uint32_t clus_num;
-    uint32_t start = FAT_START_ENT; /* skip 0, 1-th cluster of FAT */
+    FAT_CACHE *cache = &fs->fat_cache;
+    long long windows;
+    loff_t span;
+    int i;
 
-    /* 2 represent FAT_START_ENT */
-    fat_size = ((fs->clusters + 2ULL) * fs->fat_bits + 7) / BITS_PER_BYTE;
-    fs->bitmap_size = bitmap_size = (fat_size + 7) / BITS_PER_BYTE;
+    if (cache->win)
+        return;
+
+    cache->base = fs->fat_start & ~(sysconf(_SC_PAGE_SIZE) - 1);
+    cache->diff = fs->fat_start - cache->base;
+
+    /* no more windows than needed for whole FAT, counted in long long
+     * before narrowing, as -m may be much bigger than FAT */
+    span = cache->diff + fs->fat_size;
+    windows = fat_cache_size / FAT_CACHE_SIZE;
+    if (windows > (span + FAT_CACHE_SIZE - 1) / FAT_CACHE_SIZE)
+        windows = (span + FAT_CACHE_SIZE - 1) / FAT_CACHE_SIZE;
+    if (windows < 1)
+        windows = 1;
+
+    cache->size = FAT_CACHE_SIZE;
+    while (windows > FAT_CACHE_MAX_WIN) {
+        windows /= 2;
+        cache->size *= 2;
+    }
+    cache->nwin = windows;
 
-    clus_size = fs->fat_bits / BITS_PER_BYTE;
-    read_size = min(FAT_BUF, fat_size);
-    first_fat = alloc_mem(read_size);
-    if (fs->nfats > 1) {
-        second_fat = alloc_mem(read_size);
+    /* bigger windows may cover more than whole FAT */
+    if ((loff_t)cache->nwin * cache->size > span)
+        cache->nwin = (span + cache->size - 1) / cache->size;
+
+    cache->win = alloc_mem(cache->nwin * sizeof(FAT_WINDOW));
+    for (i = 0; i < cache->nwin; i++)
+        cache->win[i].index = FAT_WIN_NONE;
+
+    cache->last = NULL;
+    cache->clock = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+}
+
+void free_fat_cache(DOS_FS *fs)
+{
+    FAT_CACHE *cache = &fs->fat_cache;
+    int i;
+
+    for (i = 0; i < cache->nwin; i++) {
+        if (cache->win[i].addr)
+            fs_munmap(cache->win[i].addr, cache->size);
     }
-    remain_size = fat_size;
 
-    /* TODO: handle in case that fs->nfats is bigger than 2 */
-    if (fs->nfats > 2) {
-        printf("Not support filesystem that have more than 2 FATs\n");
+    free_mem(cache->win);
+    memset(cache, 0, sizeof(FAT_CACHE));
+
+    free_mem(fs->fat);
+    fs->fat = NULL;
+
+    free_mem(fs->fat_overlay.cluster);
+    free_mem(fs->fat_overlay.value);
+    memset(&fs->fat_overlay, 0, sizeof(FAT_OVERLAY));
+}
+
+void print_fat_cache(DOS_FS *fs)
+{
+    FAT_CACHE *cache = &fs->fat_cache;
+
+    if (!cache->win)
+        return;
+
+    printf("FAT cache : %d windows of %u bytes, %lu hits, %lu misses\n",
+            cache->nwin, cache->size, cache->hits, cache->misses);
+}
+
+/* Stores FAT entry value of cluster to 'ptr', the first byte of entry */
+static void put_fat_entry(DOS_FS *fs, uint32_t cluster, uint32_t value,
+        unsigned char *ptr)
+{
+    switch (fs->fat_bits) {
+        case 12:
+            if (cluster & 1) {
+                ptr[0] = (ptr[0] & 0x0f) | ((value & 0xf) << 4);
+                ptr[1] = value >> 4;
+            }
+            else {
+                ptr[0] = value & 0xff;
+                ptr[1] = (ptr[1] & 0xf0) | ((value >> 8) & 0xf);
+            }
+            break;
+        case 16:
+            *(uint16_t *)ptr = CT_LE_W(value);
+            break;
+        case 32:
+            *(uint32_t *)ptr = CT_LE_L(value);
+            break;
+        default:
+            die("Bad FAT entry size: %d bits.", fs->fat_bits);
     }
+}
 
-    /* make bitmap from selected FAT */
-    fs->bitmap = qalloc(&mem_queue, bitmap_size);
-    fs->real_bitmap = qalloc(&mem_queue, bitmap_size);
+static inline uint32_t hash_cluster(uint32_t cluster, uint32_t size)
+{
+    return (cluster * 0x9e3779b1U) & (size - 1);
+}
 
-    init_fat_cache(fs);
+/* Returns the slot of cluster in FAT overlay.
+ * If cluster is not in it, add new slot when 'create' is set
+ * or returns -1 if not. */
+static int find_fat_overlay(DOS_FS *fs, uint32_t cluster, int create)
+{
+    FAT_OVERLAY *ov = &fs->fat_overlay;
+    uint32_t *old_cluster;
+    uint32_t *old_value;
+    uint32_t old_size;
+    uint32_t i;
+    int slot;
 
-    /* read FAT with DEFALUT_FAT_BUF size for memory optimization */
-    while (remain_size > 0) {
-        int i;
+    if (!ov->size) {
+        if (!create)
+            return -1;
+    }
+    else {
+        for (i = hash_cluster(cluster, ov->size);
+                ov->cluster[i] != FAT_WIN_NONE; i = (i + 1) & (ov->size - 1)) {
+            if (ov->cluster[i] == cluster)
+                return i;
+        }
 
-        fs_read(fs->fat_start + offset, read_size, first_fat);
+        if (!create)
+            return -1;
 
-        if (second_fat) {
-            fs_read(fs->fat_start + fs->fat_size + offset,
-                    read_size, second_fat);
+        if (ov->cnt < ov->size / 2) {
+            ov->cluster[i] = cluster;
+            ov->cnt++;
+            return i;
         }
+    }
+
+    /* grow table twice, keep it at most half full */
+    old_cluster = ov->cluster;
+    old_value = ov->value;
+    old_size = ov->size;
+
+    ov->size = old_size ? old_size * 2 : 1024;
+    ov->cluster = alloc_mem(ov->size * sizeof(uint32_t));
+    ov->value = alloc_mem(ov->size * sizeof(uint32_t));
+    memset(ov->cluster, 0xff, ov->size * sizeof(uint32_t));
+    ov->cnt = 0;
+
+    for (i = 0; i < old_size; i++) {
+        if (old_cluster[i] != FAT_WIN_NONE) {
+            slot = find_fat_overlay(fs, old_cluster[i], TRUE);
+            ov->value[slot] = old_value[i];
+        }
+    }
 
-        /* in case of first FAT read */
-        if (offset == 0) {
-            uint32_t value;
-            uint32_t value2;
+    free_mem(old_cluster);
+    free_mem(old_value);
 
-            get_fat_entry(fs, 0, &value, first_fat);
-            get_fat_entry(fs, 0, &value2, second_fat);
+    return find_fat_overlay(fs, cluster, TRUE);
+}
 
-            first_ok = (value & FAT_EXTD(fs)) == FAT_EXTD(fs);
-            second_ok = (value2 & FAT_EXTD(fs)) == FAT_EXTD(fs);
+static int compare_cluster(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
 
-            if (second_fat && !first_ok && !second_ok) {
-                printf("Both FATs appear to be corrupt. Giving up.\n");
-                exit(EXIT_ERRORS_LEFT);
-            }
+    return x < y ? -1 : x > y;
+}
+
+/* Write changed FAT entries in FAT overlay to every FAT
+ * through fs_write() as runs of FAT_PAGE_SIZE pages, then empty it. */
+void flush_fat(DOS_FS *fs)
+{
+    FAT_OVERLAY *ov = &fs->fat_overlay;
+    uint32_t *list;
+    unsigned char *buf;
+    loff_t run_start;
+    loff_t run_end;
+    loff_t end;
+    uint32_t cnt = 0;
+    uint32_t i;
+    uint32_t j;
+    uint32_t k;
+    int n;
+
+    if (!ov->cnt)
+        return;
+
+    list = alloc_mem(ov->cnt * sizeof(uint32_t));
+    for (i = 0; i < ov->size; i++) {
+        if (ov->cluster[i] != FAT_WIN_NONE)
+            list[cnt++] = ov->cluster[i];
+    }
+    qsort(list, cnt, sizeof(uint32_t), compare_cluster);
+
+    buf = alloc_mem(FAT_BUF);
+    for (i = 0; i < cnt; i = j) {
+        /* make a run of contiguous pages which include changed entries,
+         * at most FAT_BUF bytes */
+        run_start = (loff_t)list[i] * fs->fat_bits / BITS_PER_BYTE;
+        run_start -= run_start % FAT_PAGE_SIZE;
+        run_end = run_start;
+
+        for (j = i; j < cnt; j++) {
+            if ((loff_t)list[j] * fs->fat_bits / BITS_PER_BYTE >=
+                    run_end + FAT_PAGE_SIZE)
+                break;
+
+            end = ((loff_t)list[j] * fs->fat_bits + fs->fat_bits +
+                    BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+            end = ROUND_TO_MULTIPLE(end, FAT_PAGE_SIZE);
+            if (end - run_start > FAT_BUF)
+                break;
+
+            if (end > run_end)
+                run_end = end;
         }
 
-        if (second_fat && memcmp(first_fat, second_fat, read_size) != 0) {
-            if (first_ok && !second_ok) {
-                if (flag == FAT_NONE)
-                    printf("FATs differ - using first FAT.\n");
-                flag = FAT_FIRST;
-            }
+        if (run_end > fs->fat_size)
+            run_end = fs->fat_size;
+
+        for (n = 0; n < fs->fat_copies; n++) {
+            loff_t pos = fs->fat_start + (loff_t)fs->fat_size * n + run_start;
 
-            if (!first_ok && second_ok) {
-                if (flag == FAT_NONE)
-                    printf("FATs differ - using second FAT.\n");
-                flag = FAT_SECOND;
+            fs_read(pos, run_end - run_start, buf);
+            for (k = i; k < j; k++) {
+                put_fat_entry(fs, list[k],
+                        ov->value[find_fat_overlay(fs, list[k], FALSE)],
+                        buf + (loff_t)list[k] * fs->fat_bits / BITS_PER_BYTE -
+                        run_start);
             }
+            fs_write(pos, run_end - run_start, buf);
+        }
+    }
+
+    free_mem(buf);
+    free_mem(list);
+
+    memset(ov->cluster, 0xff, ov->size * sizeof(uint32_t));
+    ov->cnt = 0;
+}
+
+/*
+ * Classification of FAT entries read by read_fat().
+ *
+ * Entries are classified BITS_PER_LONG at a time into free, bad,
+ * out of range and valid. Valid and out of range entries are set in bitmap.
+ * Kernel is selected at runtime by CPU features. FAT12 and remaining entries
+ * of a chunk are classified one by one.
+ * Differences between FAT copies are found by mismatch kernels in same way.
+ */
+typedef struct {
+    uint32_t max_clus;  /* max_clus_num */
+    uint32_t min_bad;
+    uint32_t max_bad;
+} FAT_LIMIT;
+
+/* returns mask of valid entries, masks of bad and out of range entries
+ * are returned in 'bad' and 'range' */
+typedef unsigned long (*classify_fn)(const void *ent, const FAT_LIMIT *lim,
+        unsigned long *bad, unsigned long *range);
+
+/* returns offset of the first byte differing between 'a' and 'b',
+ * 'size' if they are same */
+typedef int (*mismatch_fn)(const char *a, const char *b, int size);
+
+static classify_fn classify_word;
+static mismatch_fn fat_mismatch;
+static FAT_LIMIT fat_limit;
+
+static unsigned long classify16_scalar(const void *ent, const FAT_LIMIT *lim,
+        unsigned long *bad, unsigned long *range)
+{
+    const unsigned short *p = ent;
+    unsigned long valid = 0;
+    uint32_t value;
+    int i;
+
+    *bad = *range = 0;
+    for (i = 0; i < BITS_PER_LONG; i++) {
+        value = CF_LE_W(p[i]);
+        if (!value)
+            continue;
+
+        if (value >= lim->min_bad && value <= lim->max_bad)
+            *bad |= 1UL << i;
+        else {
+            valid |= 1UL << i;
+            if (value >= lim->max_clus && value < lim->min_bad)
+                *range |= 1UL << i;
+        }
+    }
+    return valid;
+}
+
+static unsigned long classify32_scalar(const void *ent, const FAT_LIMIT *lim,
+        unsigned long *bad, unsigned long *range)
+{
+    const unsigned int *p = ent;
+    unsigned long valid = 0;
+    uint32_t value;
+    int i;
+
+    *bad = *range = 0;
+    for (i = 0; i < BITS_PER_LONG; i++) {
+        value = CF_LE_L(p[i]) & 0x0fffffff;
+        if (!value)
+            continue;
+
+        if (value >= lim->min_bad && value <= lim->max_bad)
+            *bad |= 1UL << i;
+        else {
+            valid |= 1UL << i;
+            if (value >= lim->max_clus && value < lim->min_bad)
+                *range |= 1UL << i;
+        }
+    }
+    return valid;
+}
+
+static int mismatch_scalar(const char *a, const char *b, int size)
+{
+    unsigned long x, y;
+    int i;
+
+    for (i = 0; i + sizeof(long) <= size; i += sizeof(long)) {
+        memcpy(&x, a + i, sizeof(long));
+        memcpy(&y, b + i, sizeof(long));
+        if (x != y)
+            break;
+    }
+
+    while (i < size && a[i] == b[i])
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static int mismatch_sse2(const char *a, const char *b, int size)
+{
+    unsigned int mask;
+    int i;
+
+    for (i = 0; i + 16 <= size; i += 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *)(a + i)),
+                    _mm_loadu_si128((const __m128i *)(b + i))));
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+
+    return i + mismatch_scalar(a + i, b + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static int mismatch_avx2(const char *a, const char *b, int size)
+{
+    unsigned int mask;
+    int i;
+
+    for (i = 0; i + 32 <= size; i += 32) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i *)(a + i)),
+                    _mm256_loadu_si256((const __m256i *)(b + i))));
+        if (mask != 0xffffffff)
+            return i + __builtin_ctz(~mask);
+    }
+
+    return i + mismatch_scalar(a + i, b + i, size - i);
+}
+
+/* SSE2 has only signed compare, 16 bits entries are biased by 0x8000 */
+__attribute__((target("sse2")))
+static unsigned long classify16_sse2(const void *ent, const FAT_LIMIT *lim,
+        unsigned long *bad, unsigned long *range)
+{
+    const __m128i *p = ent;
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i empty = bias;   /* free entry after bias */
+    const __m128i min_bad = _mm_set1_epi16((short)((lim->min_bad - 1) ^ 0x8000));
+    const __m128i max_bad = _mm_set1_epi16((short)((lim->max_bad + 1) ^ 0x8000));
+    const __m128i max_clus = _mm_set1_epi16((short)((lim->max_clus - 1) ^ 0x8000));
+    unsigned long valid = 0;
+    int i;
+
+    *bad = *range = 0;
+    for (i = 0; i < BITS_PER_LONG / 16; i++) {
+        __m128i x0 = _mm_xor_si128(_mm_loadu_si128(p + 2 * i), bias);
+        __m128i x1 = _mm_xor_si128(_mm_loadu_si128(p + 2 * i + 1), bias);
+        __m128i ge_bad0 = _mm_cmpgt_epi16(x0, min_bad);
+        __m128i ge_bad1 = _mm_cmpgt_epi16(x1, min_bad);
+        __m128i is_bad0 = _mm_and_si128(ge_bad0, _mm_cmplt_epi16(x0, max_bad));
+        __m128i is_bad1 = _mm_and_si128(ge_bad1, _mm_cmplt_epi16(x1, max_bad));
+        __m128i is_free0 = _mm_cmpeq_epi16(x0, empty);
+        __m128i is_free1 = _mm_cmpeq_epi16(x1, empty);
+        __m128i is_range0 = _mm_andnot_si128(ge_bad0,
+                _mm_cmpgt_epi16(x0, max_clus));
+        __m128i is_range1 = _mm_andnot_si128(ge_bad1,
+                _mm_cmpgt_epi16(x1, max_clus));
+        unsigned long b, f, r;
+
+        b = (unsigned int)_mm_movemask_epi8(_mm_packs_epi16(is_bad0, is_bad1));
+        f = (unsigned int)_mm_movemask_epi8(_mm_packs_epi16(is_free0, is_free1));
+        r = (unsigned int)_mm_movemask_epi8(_mm_packs_epi16(is_range0, is_range1));
+
+        valid |= (~(b | f) & 0xffff) << (i * 16);
+        *bad |= b << (i * 16);
+        *range |= r << (i * 16);
+    }
+    return valid;
+}
+
+__attribute__((target("sse2")))
+static unsigned long classify32_sse2(const void *ent, const FAT_LIMIT *lim,
+        unsigned long *bad, unsigned long *range)
+{
+    const __m128i *p = ent;
+    const __m128i mask = _mm_set1_epi32(0x0fffffff);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i min_bad = _mm_set1_epi32(lim->min_bad - 1);
+    const __m128i max_bad = _mm_set1_epi32(lim->max_bad + 1);
+    const __m128i max_clus = _mm_set1_epi32(lim->max_clus - 1);
+    unsigned long valid = 0;
+    int i;
+
+    *bad = *range = 0;
+    for (i = 0; i < BITS_PER_LONG / 4; i++) {
+        __m128i x = _mm_and_si128(_mm_loadu_si128(p + i), mask);
+        __m128i ge_bad = _mm_cmpgt_epi32(x, min_bad);
+        __m128i is_bad = _mm_and_si128(ge_bad, _mm_cmplt_epi32(x, max_bad));
+        __m128i is_free = _mm_cmpeq_epi32(x, zero);
+        __m128i is_range = _mm_andnot_si128(ge_bad,
+                _mm_cmpgt_epi32(x, max_clus));
+        unsigned long b, f, r;
+
+        b = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(is_bad));
+        f = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(is_free));
+        r = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(is_range));
+
+        valid |= (~(b | f) & 0xf) << (i * 4);
+        *bad |= b << (i * 4);
+        *range |= r << (i * 4);
+    }
+    return valid;
+}
+
+/* packs_epi16 of AVX2 works in each 128 bits lane,
+ * so 64 bits quarters are reordered after packing */
+__attribute__((target("avx2")))
+static unsigned long classify16_avx2(const void *ent, const FAT_LIMIT *lim,
+        unsigned long *bad, unsigned long *range)
+{
+    const __m256i *p = ent;
+    const __m256i bias = _mm256_set1_epi16((short)0x8000);
+    const __m256i empty = bias;
+    const __m256i min_bad = _mm256_set1_epi16((short)((lim->min_bad - 1) ^ 0x8000));
+    const __m256i max_bad = _mm256_set1_epi16((short)((lim->max_bad + 1) ^ 0x8000));
+    const __m256i max_clus = _mm256_set1_epi16((short)((lim->max_clus - 1) ^ 0x8000));
+    unsigned long valid = 0;
+    int i;
+
+    *bad = *range = 0;
+    for (i = 0; i < BITS_PER_LONG / 32; i++) {
+        __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256(p + 2 * i), bias);
+        __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256(p + 2 * i + 1), bias);
+        __m256i ge_bad0 = _mm256_cmpgt_epi16(x0, min_bad);
+        __m256i ge_bad1 = _mm256_cmpgt_epi16(x1, min_bad);
+        __m256i is_bad0 = _mm256_and_si256(ge_bad0,
+                _mm256_cmpgt_epi16(max_bad, x0));
+        __m256i is_bad1 = _mm256_and_si256(ge_bad1,
+                _mm256_cmpgt_epi16(max_bad, x1));
+        __m256i is_free0 = _mm256_cmpeq_epi16(x0, empty);
+        __m256i is_free1 = _mm256_cmpeq_epi16(x1, empty);
+        __m256i is_range0 = _mm256_andnot_si256(ge_bad0,
+                _mm256_cmpgt_epi16(x0, max_clus));
+        __m256i is_range1 = _mm256_andnot_si256(ge_bad1,
+                _mm256_cmpgt_epi16(x1, max_clus));
+        unsigned long b, f, r;
+
+        b = (unsigned int)_mm256_movemask_epi8(_mm256_permute4x64_epi64(
+                    _mm256_packs_epi16(is_bad0, is_bad1), 0xd8));
+        f = (unsigned int)_mm256_movemask_epi8(_mm256_permute4x64_epi64(
+                    _mm256_packs_epi16(is_free0, is_free1), 0xd8));
+        r = (unsigned int)_mm256_movemask_epi8(_mm256_permute4x64_epi64(
+                    _mm256_packs_epi16(is_range0, is_range1), 0xd8));
+
+        valid |= (~(b | f) & 0xffffffffUL) << (i * 32);
+        *bad |= b << (i * 32);
+        *range |= r << (i * 32);
+    }
+    return valid;
+}
+
+__attribute__((target("avx2")))
+static unsigned long classify32_avx2(const void *ent, const FAT_LIMIT *lim,
+        unsigned long *bad, unsigned long *range)
+{
+    const __m256i *p = ent;
+    const __m256i mask = _mm256_set1_epi32(0x0fffffff);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i min_bad = _mm256_set1_epi32(lim->min_bad - 1);
+    const __m256i max_bad = _mm256_set1_epi32(lim->max_bad + 1);
+    const __m256i max_clus = _mm256_set1_epi32(lim->max_clus - 1);
+    unsigned long valid = 0;
+    int i;
 
-            if (first_ok && second_ok) {
-                if (flag == FAT_NONE) {
-                    if (interactive) {
-                        printf("FATs differ but appear to be intact. "
-                                "Use which FAT ?\n"
-                                "1) Use first FAT\n"
-                                "2) Use second FAT\n");
-                        if (get_key("12", "?") == '1') {
-                            flag = FAT_FIRST;
-                        } else {
-                            flag = FAT_SECOND;
-                        }
-                    }
-                    else {
-                        printf("FATs differ but appear to be intact. "
-                                "Using first FAT.\n");
-                        flag = FAT_FIRST;
-                    }
+    *bad = *range = 0;
+    for (i = 0; i < BITS_PER_LONG / 8; i++) {
+        __m256i x = _mm256_and_si256(_mm256_loadu_si256(p + i), mask);
+        __m256i ge_bad = _mm256_cmpgt_epi32(x, min_bad);
+        __m256i is_bad = _mm256_and_si256(ge_bad,
+                _mm256_cmpgt_epi32(max_bad, x));
+        __m256i is_free = _mm256_cmpeq_epi32(x, zero);
+        __m256i is_range = _mm256_andnot_si256(ge_bad,
+                _mm256_cmpgt_epi32(x, max_clus));
+        unsigned long b, f, r;
+
+        b = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(is_bad));
+        f = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(is_free));
+        r = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(is_range));
+
+        valid |= (~(b | f) & 0xff) << (i * 8);
+        *bad |= b << (i * 8);
+        *range |= r << (i * 8);
+    }
+    return valid;
+}
+#endif
+
+static void init_fat_kernels(DOS_FS *fs)
+{
+    fat_limit.max_clus = max_clus_num;
+    fat_limit.min_bad = FAT_MIN_BAD(fs);
+    fat_limit.max_bad = FAT_MAX_BAD(fs);
+
+    fat_mismatch = mismatch_scalar;
+    switch (fs->fat_bits) {
+        case 16:
+            classify_word = classify16_scalar;
+            break;
+        case 32:
+            classify_word = classify32_scalar;
+            break;
+        default:
+            classify_word = NULL;
+            break;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        fat_mismatch = mismatch_avx2;
+        if (classify_word)
+            classify_word = fs->fat_bits == 32 ?
+                classify32_avx2 : classify16_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        fat_mismatch = mismatch_sse2;
+        if (classify_word)
+            classify_word = fs->fat_bits == 32 ?
+                classify32_sse2 : classify16_sse2;
+    }
+#endif
+}
+
+/* Entry which has value out of range is set to EOF */
+static void fix_out_of_range(DOS_FS *fs, uint32_t cluster, uint32_t value)
+{
+    printf("Cluster %u out of range (%u > %u). Setting to EOF.\n",
+            cluster, value, max_clus_num - 1);
+    set_fat(fs, cluster, -1);
+}
+
+/* Classify 'cnt' entries in FAT chunk 'buf' of which first entry is
+ * for 'first' cluster. Set bitmap of valid clusters and return the number
+ * of bad clusters. 'first' is multiple of BITS_PER_LONG except for FAT12.
+ * If 'defer' is set, nothing is fixed and -1 is returned when the chunk
+ * needs fixing, then caller should classify the chunk again without it */
+static int classify_fat(DOS_FS *fs, void *buf, uint32_t first, uint32_t cnt,
+        int defer)
+{
+    int ent_size = fs->fat_bits / BITS_PER_BYTE;
+    unsigned long valid, bad, range;
+    uint32_t cluster;
+    uint32_t value;
+    uint32_t i = 0;
+    int bad_cnt = 0;
+    int bit;
+
+    if (classify_word) {
+        for (; i + BITS_PER_LONG <= cnt; i += BITS_PER_LONG) {
+            cluster = first + i;
+            valid = classify_word((char *)buf + i * ent_size, &fat_limit,
+                    &bad, &range);
+
+            /* skip 0, 1-th cluster of FAT */
+            if (cluster < FAT_START_ENT) {
+                valid &= ~0UL << FAT_START_ENT;
+                bad &= ~0UL << FAT_START_ENT;
+                range &= ~0UL << FAT_START_ENT;
+                if (bad & (1UL << FAT_START_ENT)) {
+                    if (defer)
+                        return -1;
+                    die("Root cluster's next is bad cluster!\n");
                 }
             }
 
-            if (flag == FAT_SECOND) {
-                /* TODO: how about writing immediately for FAT ?? */
-                fs_write(fs->fat_start + offset, read_size, second_fat);
+            if (range && defer)
+                return -1;
+
+            bitmap_store_word(fs->bitmap, cluster / BITS_PER_LONG, valid);
+            bad_cnt += __builtin_popcountl(bad);
 
-                /* TODO: memcpy is needed? just point second_fat isn't enough? */
-                memcpy(first_fat, second_fat, read_size);
+            while (range) {
+                bit = __builtin_ctzl(range);
+                range &= range - 1;
+                get_fat_entry(fs, i + bit, &value, buf);
+                fix_out_of_range(fs, cluster + bit, value);
             }
-            else {
-                /* TODO: how about writing immediately for FAT ?? */
-                fs_write(fs->fat_start + fs->fat_size + offset,
-                        read_size, first_fat);
+        }
+    }
+
+    for (; i < cnt; i++) {
+        cluster = first + i;
+        if (cluster < FAT_START_ENT)
+            continue;
+
+        get_fat_entry(fs, i, &value, buf);
+        if (!value)
+            continue;
+
+        /* skip setting bitmap of bad cluster */
+        if (FAT_IS_BAD(fs, value)) {
+            if (cluster == FAT_START_ENT) {
+                if (defer)
+                    return -1;
+                die("Root cluster's next is bad cluster!\n");
             }
+            bad_cnt++;
+            continue;
+        }
+
+        if (value >= max_clus_num && value < FAT_MIN_BAD(fs)) {
+            if (defer)
+                return -1;
+            fix_out_of_range(fs, cluster, value);
         }
 
-        cpr = read_size / clus_size;
-        for (i = start; i < cpr; i++) {
-            if (total_cluster + i >= max_clus_num) {
+        /* set bitmap only valid cluster */
+        bitmap_set_bit(fs->bitmap, cluster);
+    }
+
+    return bad_cnt;
+}
+
+static fat_select_t fat_select = FAT_NONE;
+static int fat_jobs = 1;
+
+void set_fat_select(fat_select_t select)
+{
+    fat_select = select;
+}
+
+void set_fat_jobs(int jobs)
+{
+#ifndef HAVE_PTHREAD
+    if (jobs > 1) {
+        fprintf(stderr, "Built without threads, FAT is read by one thread\n");
+        jobs = 1;
+    }
+#endif
+    fat_jobs = jobs;
+}
+
+/* Returns value of FAT entry of cluster in n-th FAT */
+static uint32_t get_fat_copy(DOS_FS *fs, int n, uint32_t cluster)
+{
+    unsigned char data[4];
+    uint32_t value;
+    int unit = fs->fat_bits == 12 ? 3 : fs->fat_bits / BITS_PER_BYTE;
+    int cpu = unit * BITS_PER_BYTE / fs->fat_bits;  /* clusters per unit */
+
+    fs_read(fs->fat_start + (loff_t)fs->fat_size * n +
+            (loff_t)(cluster - cluster % cpu) * fs->fat_bits / BITS_PER_BYTE,
+            unit, data);
+    get_fat_entry(fs, cluster % cpu, &value, data);
+    return value;
+}
+
+/* Check if entries of FAT 'unit' at 'pos' in chunk 'buf' of n-th FAT
+ * make sense: not out of range and not pointing free cluster */
+static int plausible_fat(DOS_FS *fs, int n, char *buf, loff_t offset,
+        int pos, int unit)
+{
+    uint32_t index = (uint32_t)pos * BITS_PER_BYTE / fs->fat_bits;
+    uint32_t cluster = (uint32_t)(offset * BITS_PER_BYTE / fs->fat_bits) + index;
+    uint32_t value;
+    int i;
+
+    for (i = 0; i < unit * BITS_PER_BYTE / fs->fat_bits; i++) {
+        if (cluster + i < FAT_START_ENT || cluster + i >= max_clus_num)
+            continue;
+
+        get_fat_entry(fs, index + i, &value, buf);
+        if (!value || FAT_IS_EOF(fs, value) || FAT_IS_BAD(fs, value))
+            continue;
+
+        if (value < FAT_START_ENT || value >= max_clus_num)
+            return 0;
+
+        if (!get_fat_copy(fs, n, value))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Copy bytes from 'start' to 'end' of FAT chunk at 'offset'
+ * from selected FAT to the other, 'second_fat' is chunk of n-th FAT */
+static void copy_fat_range(DOS_FS *fs, loff_t offset, int n, char *first_fat,
+        char *second_fat, int start, int end, fat_select_t select)
+{
+    if (select == FAT_SECOND) {
+        fs_write(fs->fat_start + offset + start, end - start,
+                second_fat + start);
+        memcpy(first_fat + start, second_fat + start, end - start);
+    }
+    else {
+        fs_write(fs->fat_start + (loff_t)fs->fat_size * n + offset + start,
+                end - start, first_fat + start);
+    }
+}
+
+/* Write only differing ranges of entries between first FAT and n-th FAT
+ * to the other FAT. FAT12 entries are compared in pairs which share bytes.
+ * In case of FAT_ENTRY, each entry is taken from the FAT of which entry
+ * makes sense, first FAT if both or neither do.
+ * Returns TRUE if 'first_fat' is changed */
+static int mirror_fat(DOS_FS *fs, loff_t offset, int n, char *first_fat,
+        char *second_fat, int size, fat_select_t select)
+{
+    int unit = fs->fat_bits == 12 ? 3 : fs->fat_bits / BITS_PER_BYTE;
+    int start, end, pos, run;
+    int changed = FALSE;
+    fat_select_t pick, prev;
+
+    start = 0;
+    while (1) {
+        start += fat_mismatch(first_fat + start, second_fat + start,
+                size - start);
+        if (start >= size)
+            break;
+
+        start -= start % unit;
+        for (end = start + unit; end < size; end += unit) {
+            if (!memcmp(first_fat + end, second_fat + end,
+                        min(unit, size - end)))
                 break;
-            }
+        }
+        end = min(end, size);
 
-            get_fat(fs, total_cluster + i, &clus_num);
-            if (!clus_num)
-                continue;
+        if (select != FAT_ENTRY) {
+            copy_fat_range(fs, offset, n, first_fat, second_fat,
+                    start, end, select);
+            changed |= select == FAT_SECOND;
+            start = end;
+            continue;
+        }
 
-            if (clus_num >= max_clus_num && clus_num < FAT_MIN_BAD(fs)) {
-                printf("Cluster %u out of range (%u > %u). Setting to EOF.\n",
-                        i, clus_num, max_clus_num - 1);
-                set_fat(fs, total_cluster + i, -1);
-                set_bit(total_cluster + i, fs->bitmap);
-                continue;
+        prev = FAT_NONE;
+        for (pos = run = start; pos < end; pos += unit) {
+            pick = FAT_FIRST;
+            if (!plausible_fat(fs, 0, first_fat, offset, pos, unit) &&
+                    plausible_fat(fs, n, second_fat, offset, pos, unit))
+                pick = FAT_SECOND;
+
+            if (prev != FAT_NONE && pick != prev) {
+                copy_fat_range(fs, offset, n, first_fat, second_fat,
+                        run, pos, prev);
+                changed |= prev == FAT_SECOND;
+                run = pos;
             }
+            prev = pick;
+        }
+        copy_fat_range(fs, offset, n, first_fat, second_fat, run, end, prev);
+        changed |= prev == FAT_SECOND;
+        start = end;
+    }
 
-            /* skip setting bitmap of bad cluster */
-            if (FAT_IS_BAD(fs, clus_num)) {
-                bad_clusters++;
-                if ((total_cluster + i) == FAT_START_ENT) {
-                    die("Root cluster's next is bad cluster!\n");
+    return changed;
+}
+
+/* Decide which FAT is used when first FAT and n-th FAT differ first.
+ * 'ok' tells which FATs have sane first entry. In case of FAT_SECOND,
+ * number of the FAT to use is returned in 'src' */
+static fat_select_t select_fat(DOS_FS *fs, int *ok, int n, int *src)
+{
+    int i;
+
+    *src = n;
+    if (ok[0] && !ok[n]) {
+        printf("FATs differ - using first FAT.\n");
+        return FAT_FIRST;
+    }
+
+    if (!ok[0]) {
+        /* some FAT is intact, otherwise read_fat() gave up already */
+        for (i = n; !ok[i]; i++)
+            ;
+
+        if (fs->fat_copies == 2)
+            printf("FATs differ - using second FAT.\n");
+        else
+            printf("FATs differ - using FAT %d.\n", i + 1);
+
+        *src = i;
+        return FAT_SECOND;
+    }
+
+    if (fat_select == FAT_ENTRY) {
+        printf("FATs differ but appear to be intact. "
+                "Choosing each differing entry.\n");
+        return FAT_ENTRY;
+    }
+
+    if (interactive) {
+        printf("FATs differ but appear to be intact. Use which FAT ?\n"
+                "1) Use first FAT\n");
+        if (n == 1)
+            printf("2) Use second FAT\n");
+        else
+            printf("2) Use FAT %d\n", n + 1);
+
+        return get_key("12", "?") == '1' ? FAT_FIRST : FAT_SECOND;
+    }
+
+    printf("FATs differ but appear to be intact. Using first FAT.\n");
+    return FAT_FIRST;
+}
+
+/* State of read_fat() shared by chunks */
+typedef struct {
+    int *ok;            /* FATs of which first entry is sane */
+    int src;            /* FAT to use in case of FAT_SECOND */
+    fat_select_t flag;  /* how to repair differing FATs, decided once */
+    uint32_t fat_size;  /* bytes of FAT in use */
+} FAT_READ;
+
+#ifdef HAVE_PTHREAD
+/* Per-thread state of parallel read_fat() */
+typedef struct {
+    DOS_FS *fs;
+    FAT_READ *rd;
+    char *first_fat;
+    char *other_fat;
+    unsigned char *pending; /* chunks to be read again by read_fat_chunk() */
+    uint32_t start;         /* first chunk */
+    uint32_t end;           /* last chunk + 1 */
+    uint32_t bad;           /* number of bad clusters */
+    pthread_t thread;
+} FAT_WORKER;
+#endif
+
+static inline int chunk_size(FAT_READ *rd, uint32_t chunk)
+{
+    return min(FAT_BUF, rd->fat_size - (loff_t)chunk * FAT_BUF);
+}
+
+/* Returns the number of entries to classify in 'size' bytes of FAT chunk */
+static inline uint32_t chunk_clusters(DOS_FS *fs, uint32_t chunk, int size)
+{
+    uint32_t first = (loff_t)chunk * FAT_BUF * BITS_PER_BYTE / fs->fat_bits;
+    uint32_t cnt = size * BITS_PER_BYTE / fs->fat_bits;
+
+    return first + cnt > max_clus_num ? max_clus_num - first : cnt;
+}
+
+/* Read one chunk of FAT, make every FAT in use same as selected FAT and
+ * classify entries of it. Other FATs are compared with first FAT one by one,
+ * so only one more chunk buffer is needed whatever number of FATs is. */
+static void read_fat_chunk(DOS_FS *fs, FAT_READ *rd, uint32_t chunk,
+        char *first_fat, char *other_fat)
+{
+    loff_t offset = (loff_t)chunk * FAT_BUF;
+    int read_size = chunk_size(rd, chunk);
+    int last;
+    int n;
+
+    fs_read(fs->fat_start + offset, read_size, first_fat);
+
+    /* take chunk of selected FAT into first FAT first */
+    if (rd->flag == FAT_SECOND) {
+        fs_read(fs->fat_start + (loff_t)fs->fat_size * rd->src + offset,
+                read_size, other_fat);
+        mirror_fat(fs, offset, rd->src, first_fat, other_fat, read_size,
+                FAT_SECOND);
+    }
+
+    /* 'last' is the last FAT which was compared before 'first_fat'
+     * changed, FATs before it are written again below */
+    last = 0;
+    for (n = 1; n < fs->fat_copies; n++) {
+        fs_read(fs->fat_start + (loff_t)fs->fat_size * n + offset,
+                read_size, other_fat);
+
+        if (rd->flag == FAT_NONE &&
+                memcmp(first_fat, other_fat, read_size) != 0) {
+            rd->flag = select_fat(fs, rd->ok, n, &rd->src);
+            if (rd->flag == FAT_SECOND) {
+                if (rd->src != n) {
+                    fs_read(fs->fat_start + (loff_t)fs->fat_size * rd->src +
+                            offset, read_size, other_fat);
                 }
+                mirror_fat(fs, offset, rd->src, first_fat, other_fat,
+                        read_size, FAT_SECOND);
+
+                /* compare again from n-th FAT if it isn't selected */
+                last = n - 1;
+                if (rd->src != n)
+                    n--;
                 continue;
             }
+        }
+
+        /* TODO: how about writing immediately for FAT ?? */
+        if (mirror_fat(fs, offset, n, first_fat, other_fat, read_size,
+                    rd->flag == FAT_SECOND ? FAT_FIRST : rd->flag))
+            last = n - 1;
+    }
+
+    for (n = 1; n <= last; n++) {
+        fs_read(fs->fat_start + (loff_t)fs->fat_size * n + offset,
+                read_size, other_fat);
+        mirror_fat(fs, offset, n, first_fat, other_fat, read_size, FAT_FIRST);
+    }
+
+    if (fs->fat)
+        memcpy(fs->fat + offset, first_fat, read_size);
+
+    bad_clusters += classify_fat(fs, first_fat,
+            offset * BITS_PER_BYTE / fs->fat_bits,
+            chunk_clusters(fs, chunk, read_size), FALSE);
+}
 
-            /* set bitmap only valid cluster */
-            set_bit(total_cluster + i, fs->bitmap);
+#ifdef HAVE_PTHREAD
+/* Read and classify chunks of a worker in which all FATs are same and
+ * nothing needs fixing. Other chunks are left pending, so that they are
+ * repaired in order by read_fat_chunk() with same result as one thread. */
+static void *read_fat_worker(void *arg)
+{
+    FAT_WORKER *w = arg;
+    DOS_FS *fs = w->fs;
+    loff_t offset;
+    uint32_t chunk;
+    int read_size;
+    int bad;
+    int n;
+
+    for (chunk = w->start; chunk < w->end; chunk++) {
+        offset = (loff_t)chunk * FAT_BUF;
+        read_size = chunk_size(w->rd, chunk);
+
+        fs_pread(fs->fat_start + offset, read_size, w->first_fat);
+        for (n = 1; n < fs->fat_copies; n++) {
+            fs_pread(fs->fat_start + (loff_t)fs->fat_size * n + offset,
+                    read_size, w->other_fat);
+            if (fat_mismatch(w->first_fat, w->other_fat, read_size) <
+                    read_size)
+                break;
         }
 
-        start = 0;
-        total_cluster += i;
-        offset += read_size;
+        bad = -1;
+        if (n == fs->fat_copies)
+            bad = classify_fat(fs, w->first_fat,
+                    offset * BITS_PER_BYTE / fs->fat_bits,
+                    chunk_clusters(fs, chunk, read_size), TRUE);
+        if (bad < 0) {
+            w->pending[chunk] = 1;
+            continue;
+        }
+
+        if (fs->fat)
+            memcpy(fs->fat + offset, w->first_fat, read_size);
+        w->bad += bad;
+    }
+
+    return NULL;
+}
+
+/* Read FAT by 'jobs' threads, each of which reads a contiguous range of
+ * chunks into disjoint part of bitmap. Then pending chunks are read in order.
+ * Chunks of threads which can't be created are read in the same way. */
+static void read_fat_parallel(DOS_FS *fs, FAT_READ *rd, uint32_t chunks,
+        int jobs, char *first_fat, char *other_fat)
+{
+    FAT_WORKER *workers;
+    unsigned char *pending;
+    uint32_t chunk;
+    int i;
+
+    workers = alloc_mem(jobs * sizeof(FAT_WORKER));
+    pending = alloc_mem(chunks);
+
+    for (i = 0; i < jobs; i++) {
+        workers[i].fs = fs;
+        workers[i].rd = rd;
+        workers[i].first_fat = alloc_mem(FAT_BUF);
+        if (fs->fat_copies > 1)
+            workers[i].other_fat = alloc_mem(FAT_BUF);
+        workers[i].pending = pending;
+        workers[i].start = (uint64_t)chunks * i / jobs;
+        workers[i].end = (uint64_t)chunks * (i + 1) / jobs;
+    }
+
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&workers[i].thread, NULL, read_fat_worker,
+                    &workers[i])) {
+            memset(pending + workers[i].start, 1,
+                    workers[i].end - workers[i].start);
+            workers[i].end = 0;     /* not started */
+        }
+    }
+
+    for (i = 0; i < jobs; i++) {
+        if (workers[i].end)
+            pthread_join(workers[i].thread, NULL);
+        bad_clusters += workers[i].bad;
+        free_mem(workers[i].first_fat);
+        free_mem(workers[i].other_fat);
+    }
+
+    for (chunk = 0; chunk < chunks; chunk++) {
+        if (pending[chunk])
+            read_fat_chunk(fs, rd, chunk, first_fat, other_fat);
+    }
+
+    free_mem(pending);
+    free_mem(workers);
+}
+#endif
+
+/* Reserved entries fit in 4 bytes for all FAT types */
+#define FAT_HEAD_SIZE   4
+
+void read_fat_head(DOS_FS *fs)
+{
+    if (fs->fat_bits == 32) {
+        init_fat_cache(fs);
+    }
+    else if (!fs->fat) {
+        fs->fat = alloc_mem(FAT_HEAD_SIZE);
+        fs_read(fs->fat_start, FAT_HEAD_SIZE, fs->fat);
+    }
+}
+
+void read_fat(DOS_FS *fs)
+{
+    FAT_READ rd;
+    int read_size;
+    int copies_ok;
+#ifdef HAVE_PTHREAD
+    int jobs;
+#endif
+    int n;
+    uint32_t chunks;
+    uint32_t chunk;
+    char *first_fat = NULL;
+    char *other_fat = NULL;
+
+    /* FAT is read through fs_read(), changes of previous pass
+     * should be there */
+    flush_fat(fs);
+
+    /* 2 represent FAT_START_ENT */
+    rd.fat_size = ((fs->clusters + 2ULL) * fs->fat_bits + 7) / BITS_PER_BYTE;
+    fs->bitmap_size = BIT_WORD(max_clus_num) * sizeof(long) + sizeof(long);
+    rd.flag = FAT_NONE;
+    rd.src = 0;
+
+    /* first entry of FAT has media descriptor and all other bits set */
+    rd.ok = alloc_mem(fs->fat_copies * sizeof(int));
+    for (n = 0, copies_ok = 0; n < fs->fat_copies; n++) {
+        rd.ok[n] = (get_fat_copy(fs, n, 0) & FAT_EXTD(fs)) == FAT_EXTD(fs);
+        copies_ok |= rd.ok[n];
+    }
+
+    if (fs->fat_copies > 1 && !copies_ok) {
+        if (fs->fat_copies == 2)
+            printf("Both FATs appear to be corrupt. Giving up.\n");
+        else
+            printf("All FATs appear to be corrupt. Giving up.\n");
+        exit(EXIT_ERRORS_LEFT);
+    }
+
+    read_size = min(FAT_BUF, rd.fat_size);
+    first_fat = alloc_mem(read_size);
+    if (fs->fat_copies > 1) {
+        other_fat = alloc_mem(read_size);
+    }
+
+    /* make bitmap from selected FAT */
+    free_cluster_bitmaps(fs);
+    fs->bitmap = alloc_cluster_bitmap(fs);
+    fs->real_bitmap = alloc_cluster_bitmap(fs);
+
+    init_fat_kernels(fs);
+
+    if (fs->fat_bits == 32) {
+        init_fat_cache(fs);
+    }
+    else if (!fs->fat) {
+        /* FAT12/16 is small enough to keep whole FAT in memory.
+         * Extra bytes are for the entry of max_clus_num. */
+        fs->fat = alloc_mem(rd.fat_size + 4);
+    }
 
-        remain_size -= read_size;
-        if (remain_size && remain_size < read_size)
-            read_size = remain_size;
+    /* read FAT with DEFALUT_FAT_BUF size for memory optimization,
+     * FAT_BUF is multiple of BITS_PER_LONG entries for all FAT types,
+     * so threads never share a chunk of bitmap */
+    chunks = (rd.fat_size + FAT_BUF - 1) / FAT_BUF;
+#ifdef HAVE_PTHREAD
+    jobs = min(fat_jobs, chunks);
+    if (jobs > 1) {
+        read_fat_parallel(fs, &rd, chunks, jobs, first_fat, other_fat);
+    }
+    else
+#endif
+    {
+        for (chunk = 0; chunk < chunks; chunk++)
+            read_fat_chunk(fs, &rd, chunk, first_fat, other_fat);
     }
 
-    if (second_fat) {
-        free_mem(second_fat);
+    if (other_fat) {
+        free_mem(other_fat);
     }
 
     free_mem(first_fat);
+    free_mem(rd.ok);
 }
 
-/* read_fat_cache apply only FAT32 */
-static void read_fat_cache(DOS_FS *fs, uint32_t cluster)
+/* Returns the address of FAT entry of cluster in FAT cache.
+ * FAT cache apply only FAT32 */
+static char *get_fat_cache(DOS_FS *fs, uint32_t cluster)
 {
-    loff_t mmap_offset;
-    loff_t aligned_offset;
+    FAT_CACHE *cache = &fs->fat_cache;
+    FAT_WINDOW *win;
+    FAT_WINDOW *lru;
+    loff_t offset;
+    uint32_t index;
+    int i;
 
     if (cluster > max_clus_num) {
         die("Cluster number is more than max cluster number. exit!\n");
     }
 
-    mmap_offset = fs->fat_start + cluster * fs->fat_bits / BITS_PER_BYTE;
-    aligned_offset = mmap_offset & ~(sysconf(_SC_PAGE_SIZE) - 1);
+    offset = cache->diff + (loff_t)cluster * fs->fat_bits / BITS_PER_BYTE;
+    index = offset / cache->size;
 
-    /* fat_start is already page aligned address */
-    if (fs->fat_cache.diff == 0) {
-        fs->fat_cache.cnt = fs->fat_cache.cpc;
-        fs->fat_cache.start = (cluster >= FAT_START_ENT) ?
-            (cluster / fs->fat_cache.cpc) *  fs->fat_cache.cpc : 0;
+    win = cache->last;
+    if (win && win->index == index) {
+        cache->hits++;
+        return win->addr + offset % cache->size;
     }
-    /* fat_start is not page aligned address */
-    else {
-        /* first cache */
-        if (cluster < fs->fat_cache.first_cpc) {
-            fs->fat_cache.start = 0;
-            fs->fat_cache.cnt = fs->fat_cache.first_cpc;
-        }
-        /* last cache */
-        else if (cluster >= max_clus_num - fs->fat_cache.last_cpc) {
-            fs->fat_cache.start =
-                ((cluster - fs->fat_cache.first_cpc) / fs->fat_cache.cpc) *
-                fs->fat_cache.cpc + fs->fat_cache.first_cpc;
-            fs->fat_cache.cnt = fs->fat_cache.last_cpc;
-        }
-        /* others */
-        else {
-            fs->fat_cache.cnt = fs->fat_cache.cpc;
-            fs->fat_cache.start =
-                ((cluster - fs->fat_cache.first_cpc) / fs->fat_cache.cpc) *
-                fs->fat_cache.cpc + fs->fat_cache.first_cpc;
+
+    lru = win = NULL;
+    for (i = 0; i < cache->nwin; i++) {
+        if (cache->win[i].index == index) {
+            win = &cache->win[i];
+            break;
         }
+
+        if (!lru || cache->win[i].used < lru->used)
+            lru = &cache->win[i];
     }
 
-    /* munmap for previous memory mapping and mmap new FAT area
-     * that include cluster */
-    if (fs->fat_cache.addr != NULL) {
-        fs_munmap(fs->fat_cache.addr, FAT_CACHE_SIZE);
+    if (win) {
+        cache->hits++;
+    }
+    else {
+        /* munmap least recently used window and mmap new FAT area
+         * that include cluster */
+        cache->misses++;
+        win = lru;
+        if (win->addr)
+            fs_munmap(win->addr, cache->size);
+
+        win->addr = fs_mmap(NULL, cache->base + (loff_t)index * cache->size,
+                cache->size);
+        win->index = index;
     }
 
-    fs->fat_cache.addr = fs_mmap(NULL, aligned_offset, FAT_CACHE_SIZE);
+    win->used = ++cache->clock;
+    cache->last = win;
+
+    return win->addr + offset % cache->size;
 }
 
 void get_fat(DOS_FS *fs, uint32_t cluster, uint32_t *value)
 {
     loff_t offset;
     int clus_size;
+    int slot;
 
     switch (fs->fat_bits) {
-        case 12: {
-            unsigned char data[2];
-
-            clus_size = 2;
-            offset = fs->fat_start + cluster * 3 / 2;
-            fs_read(offset, clus_size, data);
-
-            *value = 0xfff & (cluster & 1 ? (data[0] >> 4) | (data[1] << 4) :
-                    (data[0] | data[1] << 8));
-            break;
-        }
-        case 16: {
-            unsigned short data;
-
-            clus_size = 2;
-
-            /* TODO: is it needed applying fat_cache? */
-            offset = fs->fat_start + cluster * clus_size;
-            fs_read(offset, clus_size, &data);
+        case 12:
+        case 16:
+            if (cluster > max_clus_num) {
+                die("Cluster number is more than max cluster number. exit!\n");
+            }
 
-            *value = CF_LE_W(data);
+            get_fat_entry(fs, cluster, value, fs->fat);
             break;
-        }
         case 32: {
             uint32_t data;
 
             clus_size = 4;
-            if (!(cluster >= fs->fat_cache.start &&
-                        cluster < fs->fat_cache.start + fs->fat_cache.cnt)) {
-                read_fat_cache(fs, cluster);
-            }
-
-            /* offset in cache */
-            offset = ((cluster - fs->fat_cache.start) * clus_size) % FAT_CACHE_SIZE;
-            /* adjust first fat cache offset for unaligned fat_start device */
-            if (cluster < fs->fat_cache.first_cpc)
-                offset += fs->fat_cache.diff;
-
-            data = *(uint32_t *)(fs->fat_cache.addr + offset);
+            data = *(uint32_t *)get_fat_cache(fs, cluster);
 
             /* offset in block device */
             offset = fs->fat_start + cluster * clus_size;
@@ -330,6 +1303,10 @@ void get_fat(DOS_FS *fs, uint32_t cluster, uint32_t *value)
             /* According to MS, the high 4 bits of a FAT32 entry are reserved and
              * are not part of the cluster number. So we cut them off. */
             data = CF_LE_L(data);
+            slot = find_fat_overlay(fs, cluster, FALSE);
+            if (slot >= 0)
+                data = fs->fat_overlay.value[slot];
+
             *value = data & 0x0fffffff;
             break;
         }
@@ -345,7 +1322,7 @@ void get_fat_entry(DOS_FS *fs, uint32_t cluster, uint32_t *value, void *fat)
     switch (fs->fat_bits) {
         case 12:
             ptr = &((unsigned char *)fat)[cluster * 3 / 2];
-            *value = 0xfff && (cluster & 1 ? (ptr[0] >> 4) | (ptr[1] << 4) :
+            *value = 0xfff & (cluster & 1 ? (ptr[0] >> 4) | (ptr[1] << 4) :
                     (ptr[0] | ptr[1] << 8));
             break;
         case 16:
@@ -368,6 +1345,7 @@ void __set_fat(DOS_FS *fs, uint32_t cluster, uint32_t new, int immed)
     unsigned char data[4];
     loff_t offset;
     int clus_size;
+    int slot;
     int i;
     void (*fat_write)(loff_t pos, int size, void *data);
 
@@ -380,53 +1358,56 @@ void __set_fat(DOS_FS *fs, uint32_t cluster, uint32_t new, int immed)
         uint32_t value;
 
         case 12:
-
-            clus_size = 2;
-            offset = fs->fat_start + cluster * 3 / 2;
-
-            if (cluster & 1) {
-                get_fat(fs, cluster - 1, &value);
-
-                data[0] = ((new & 0xf) << 4) | (value >> 8);
-                data[1] = new >> 4;
-            }
-            else {
-                get_fat(fs, cluster + 1, &value);
-
-                data[0] = new & 0xff;
-                data[1] = (new >> 8) |
-                    (cluster == fs->clusters - 1 ? 0 : (0xff & value) << 4);
-            }
-            break;
-
         case 16:
-            clus_size = 2;
-            offset = fs->fat_start + cluster * clus_size;
-            *(uint16_t *)data = CT_LE_W(new);
+            /* keep resident FAT same as FAT with changes */
+            put_fat_entry(fs, cluster, new,
+                    fs->fat + cluster * fs->fat_bits / BITS_PER_BYTE);
             break;
 
         case 32:
-            clus_size = 4;
-            offset = fs->fat_start + cluster * clus_size;
-            get_fat(fs, cluster, (uint32_t *)data);
+            get_fat(fs, cluster, &value);
 
             /* According to MS, the high 4 bits of a FAT32 entry are reserved and
              * are not part of the cluster number. So we cut them off. */
-            *(uint32_t *)data =
-                CT_LE_L((new & 0xfffffff) | (*(uint32_t *)data & 0xf0000000));
+            new = (new & 0xfffffff) | (value & 0xf0000000);
             break;
 
         default:
             die("Bad FAT entry size: %d bits.", fs->fat_bits);
     }
 
+    /* changed entries are written all together by flush_fat() */
+    if (!immed && !write_immed) {
+        slot = find_fat_overlay(fs, cluster, TRUE);
+        fs->fat_overlay.value[slot] = new;
+        return;
+    }
+
+    slot = find_fat_overlay(fs, cluster, FALSE);
+    if (slot >= 0)
+        fs->fat_overlay.value[slot] = new;
+
+    offset = fs->fat_start + cluster * fs->fat_bits / BITS_PER_BYTE;
+    if (fs->fat_bits == 32) {
+        clus_size = 4;
+        put_fat_entry(fs, cluster, new, data);
+    }
+    else {
+        /* FAT12 entry shares a byte with next or previous entry. Take that
+         * half from the device, the resident FAT may have an overlay value
+         * of the neighbour which only flush_fat() should write. */
+        clus_size = 2;
+        fs_read(offset, clus_size, data);
+        put_fat_entry(fs, cluster, new, data);
+    }
+
     if (immed)
         fat_write = fs_write_immed;
     else
         fat_write = fs_write;
 
     fat_write(offset, clus_size, &data);
-    for (i = 1; i < fs->nfats; i++) {
+    for (i = 1; i < fs->fat_copies; i++) {
         fat_write(offset + (fs->fat_size * i), clus_size, &data);
     }
 }
@@ -471,6 +1452,76 @@ uint32_t next_cluster(DOS_FS *fs, uint32_t cluster)
     return next_clus;
 }
 
+/* Returns the number of FAT32 entries from 'cluster', at most 'max', which
+ * are read at once from a window of FAT cache. The entries before the last
+ * point to the next cluster, value of the last is returned in 'value' */
+static uint32_t get_fat32_run(DOS_FS *fs, uint32_t cluster, uint32_t max,
+        uint32_t *value)
+{
+    FAT_CACHE *cache = &fs->fat_cache;
+    FAT_OVERLAY *ov = &fs->fat_overlay;
+    uint32_t buf[FAT_PAGE_SIZE / sizeof(uint32_t)];
+    loff_t offset = cache->diff + (loff_t)cluster * sizeof(uint32_t);
+    uint32_t cnt;
+    uint32_t i;
+    int slot;
+
+    /* not to cross the end of window */
+    cnt = (cache->size - offset % cache->size) / sizeof(uint32_t);
+    if (cnt > FAT_PAGE_SIZE / sizeof(uint32_t))
+        cnt = FAT_PAGE_SIZE / sizeof(uint32_t);
+    if (cnt > max)
+        cnt = max;
+    if (cnt > max_clus_num - cluster)
+        cnt = max_clus_num - cluster;
+
+    memcpy(buf, get_fat_cache(fs, cluster), cnt * sizeof(uint32_t));
+    fs_find_data_copy(fs->fat_start + (loff_t)cluster * sizeof(uint32_t),
+            cnt * sizeof(uint32_t), buf);
+
+    for (i = 0; i < cnt; i++) {
+        *value = CF_LE_L(buf[i]);
+        if (ov->cnt) {
+            slot = find_fat_overlay(fs, cluster + i, FALSE);
+            if (slot >= 0)
+                *value = ov->value[slot];
+        }
+
+        *value &= 0x0fffffff;
+        if (*value != cluster + i + 1)
+            return i + 1;
+    }
+
+    return cnt;
+}
+
+void get_fat_extent(DOS_FS *fs, uint32_t cluster, uint32_t max,
+        FAT_EXTENT *ext)
+{
+    uint32_t value;
+    uint32_t cnt;
+
+    ext->start = cluster;
+    ext->len = 0;
+    do {
+        if (fs->fat_bits == 32 && cluster >= FAT_START_ENT &&
+                cluster + ext->len < max_clus_num) {
+            cnt = get_fat32_run(fs, cluster + ext->len, max - ext->len,
+                    &value);
+        }
+        else {
+            get_fat(fs, cluster + ext->len, &value);
+            cnt = 1;
+        }
+        ext->len += cnt;
+
+        /* cluster 0, 1 and the last cluster don't make a run */
+    } while (value == cluster + ext->len && ext->len < max &&
+            cluster >= FAT_START_ENT && value < max_clus_num);
+
+    ext->next = FAT_IS_EOF(fs, value) ? -1 : value;
+}
+
 loff_t cluster_start(DOS_FS *fs, uint32_t cluster)
 {
     return fs->data_start +
@@ -498,34 +1549,49 @@ inline void dec_alloc_cluster(void)
  * set_exclusive_bitmap() be called. */
 inline void set_bitmap_reclaim(DOS_FS *fs, uint32_t cluster)
 {
-    set_bit(cluster, fs->bitmap);
+    bitmap_set_bit(fs->bitmap, cluster);
     alloc_clusters++;
 }
 
 inline void clear_bitmap_reclaim(DOS_FS *fs, uint32_t cluster)
 {
-    clear_bit(cluster, fs->bitmap);
+    bitmap_clear_bit(fs->bitmap, cluster);
     alloc_clusters--;
 }
 
 inline void set_bitmap_occupied(DOS_FS *fs, uint32_t cluster)
 {
-    set_bit(cluster, fs->bitmap);
-    if (!test_bit(cluster, fs->real_bitmap)) {
+    bitmap_set_bit(fs->bitmap, cluster);
+    if (!bitmap_test_bit(fs->real_bitmap, cluster)) {
         alloc_clusters++;
-        set_bit(cluster, fs->real_bitmap);
+        bitmap_set_bit(fs->real_bitmap, cluster);
     }
 }
 
 inline void clear_bitmap_occupied(DOS_FS *fs, uint32_t cluster)
 {
-    clear_bit(cluster, fs->bitmap);
-    if (test_bit(cluster, fs->real_bitmap)) {
-        clear_bit(cluster, fs->real_bitmap);
+    bitmap_clear_bit(fs->bitmap, cluster);
+    if (bitmap_test_bit(fs->real_bitmap, cluster)) {
+        bitmap_clear_bit(fs->real_bitmap, cluster);
         alloc_clusters--;
     }
 }
 
+/* Range versions of set/clear_bitmap_occupied() */
+void set_bitmap_occupied_range(DOS_FS *fs, uint32_t cluster, uint32_t cnt)
+{
+    bitmap_set_range(fs->bitmap, cluster, cnt);
+    alloc_clusters += cnt - bitmap_count(fs->real_bitmap, cluster, cnt);
+    bitmap_set_range(fs->real_bitmap, cluster, cnt);
+}
+
+void clear_bitmap_occupied_range(DOS_FS *fs, uint32_t cluster, uint32_t cnt)
+{
+    bitmap_clear_range(fs->bitmap, cluster, cnt);
+    alloc_clusters -= bitmap_count(fs->real_bitmap, cluster, cnt);
+    bitmap_clear_range(fs->real_bitmap, cluster, cnt);
+}
+
 void fix_bad(DOS_FS *fs)
 {
     uint32_t i;
@@ -534,15 +1600,8 @@ void fix_bad(DOS_FS *fs)
     if (verbose)
         printf("Checking for bad clusters.\n");
 
-    for (i = FAT_START_ENT; i < max_clus_num; i++) {
-        if (test_bit(i, fs->real_bitmap)) {
-            /* check 64bit at once */
-            if (fs->real_bitmap[i / BITS_PER_LONG] == 0xffffffff) {
-                i = ((i / BITS_PER_LONG) * BITS_PER_LONG) + BITS_PER_LONG - 1;
-            }
-            continue;
-        }
-
+    /* only clusters not used by any file */
+    for_each_bitmap_clear(i, FAT_START_ENT, max_clus_num, fs->real_bitmap) {
         get_fat(fs, i, &next_clus);
         if (!FAT_IS_BAD(fs, next_clus)) {
             if (!fs_test(cluster_start(fs, i), fs->cluster_size)) {
@@ -568,15 +1627,7 @@ void reclaim_free(DOS_FS *fs)
     set_exclusive_bitmap(fs);
 
     /* Do not set bitmap in reclaim routine */
-    for (i = FAT_START_ENT; i < max_clus_num; i++) {
-        if (!test_bit(i, fs->real_bitmap)) {
-            /* TODO: check 64bit at once */
-            if (fs->real_bitmap[i / BITS_PER_LONG] == 0) {
-                i = ((i / BITS_PER_LONG) * BITS_PER_LONG) + BITS_PER_LONG - 1;
-            }
-            continue;
-        }
-
+    for_each_bitmap_set(i, FAT_START_ENT, max_clus_num, fs->real_bitmap) {
         get_fat(fs, i, &next_clus);
         if (next_clus && !FAT_IS_BAD(fs, next_clus)) {
             set_fat(fs, i, 0);
@@ -590,189 +1641,180 @@ void reclaim_free(DOS_FS *fs)
                 (unsigned long long)reclaimed * fs->cluster_size);
 }
 
-/* Find start cluster of orphan files.
- * After function call, start clusters are remained as set bit in real_bitmap */
-static void find_start_clusters(DOS_FS *fs)
+/* Find start cluster of orphan files in two passes over orphan clusters.
+ * The first pass marks orphan clusters whose own entry is free or bad in
+ * 'dead', so that the second pass can check the target of each link
+ * without looking up its FAT entry out of order.
+ * A cluster pointed by other orphan cluster is set in 'pred'.
+ * Chains merging into a cluster which has already a predecessor,
+ * self cycles and chains running into used or invalid clusters are cut.
+ * After function call, start clusters are remained as set bit in real_bitmap
+ * and other orphan clusters are remained as set bit in 'pred' */
+static void find_start_clusters(DOS_FS *fs, BITMAP *pred)
 {
-    uint32_t prev;
-    uint32_t i, walk;
-    uint32_t next_clus;
-    uint32_t cnt;
+    uint32_t i;
+    uint32_t next;
+    uint32_t value;
+    BITMAP *dead;
 
-    for (i = FAT_START_ENT; i < max_clus_num; i++) {
-        if (!test_bit(i, fs->real_bitmap)) {
-            /* check 64bit at once */
-            if (fs->real_bitmap[i / BITS_PER_LONG] == 0) {
-                i = ((i / BITS_PER_LONG) * BITS_PER_LONG) + BITS_PER_LONG - 1;
-            }
+    dead = alloc_cluster_bitmap(fs);
+    for_each_bitmap_set(i, FAT_START_ENT, max_clus_num, fs->real_bitmap) {
+        get_fat(fs, i, &value);
+        if (!value || FAT_IS_BAD(fs, value))
+            bitmap_set_bit(dead, i);
+    }
+
+    /* if bit is set, that cluster is orphan cluster */
+    for_each_bitmap_set(i, FAT_START_ENT, max_clus_num, fs->real_bitmap) {
+        next = __next_cluster(fs, i);
+        if (FAT_IS_BAD(fs, next)) {
+            set_fat(fs, i, -1);
+            bitmap_clear_bit(dead, i);
             continue;
         }
 
-        next_clus = __next_cluster(fs, i);
-        if (next_clus && !FAT_IS_BAD(fs, next_clus)) {
-            prev = i;
-            cnt = 1;
-            for (walk = next_clus; walk > 0 && walk != -1;
-                    walk = __next_cluster(fs, walk)) {
-
-                /* broke self cycle case */
-                if (prev == walk) {
-                    set_fat(fs, prev, -1);
-                    break;
-                }
+        if (!next || next >= max_clus_num)
+            continue;
 
-                if (FAT_IS_BAD(fs, walk)) {
-                    set_fat(fs, prev, -1);
-                    break;
-                }
+        /* In case that i's next cluster is already in other cluster chain
+         * or i's next cluster has wrong cluster value */
+        if (!bitmap_test_bit(fs->real_bitmap, next) ||
+                bitmap_test_bit(fs->bitmap, next) ||
+                bitmap_test_bit(dead, next)) {
+            set_fat(fs, i, -1);
+            continue;
+        }
 
-                if (test_bit(walk, fs->real_bitmap)) {
-                    /* walk is not start cluster, just clear bit */
-                    clear_bit(walk, fs->real_bitmap);
-                }
-                else {
-                    set_fat(fs, prev, -1);
-                    break;
-                }
-                prev = walk;
-                cnt++;
-                if (cnt > fs->clusters) {
-                    printf("Orphan cluster(%d) has cluster chain cycle\n", i);
-                    break;;
-                }
-            }
+        /* self cycle, or next has another predecessor already */
+        if (next == i || bitmap_test_bit(pred, next)) {
+            set_fat(fs, i, -1);
+            continue;
         }
+
+        bitmap_set_bit(pred, next);
     }
+
+    free_bitmap(dead);
+    bitmap_andnot(fs->real_bitmap, pred);
 }
 
-void reclaim_file(DOS_FS *fs)
+/* Make a file entry for orphan chain from 'start'.
+ * The chain is followed link by link, so its FAT entries are read in
+ * chain order rather than in cluster order. */
+static uint32_t reclaim_chain(DOS_FS *fs, uint32_t start, struct tm *ctime)
 {
-    int reclaimed, files;
-    uint32_t i, next, walk;
-    struct tm *ctime;
-    time_t current;
+    DIR_ENT de;
+    loff_t offset;
+    uint32_t clus_cnt;
+    uint32_t prev, walk;
 
-    time(&current);
-    ctime = localtime(&current);
+    if (fs->root_cluster)
+        offset = alloc_reclaimed_entry(fs, &de, "FSCK%04dREC");
+    else
+        offset = alloc_rootdir_entry(fs, &de, "FSCK%04dREC");
 
-    if (verbose)
-        printf("Reclaiming unconnected clusters.\n");
+    de.start = CT_LE_W(start & 0xffff);
 
-    /* Remove checked cluster bits. After function called,
-     * remained bit in real_bitmap represent orphan clusters.
-     * And bitmap preserves previous real_bitmap */
-    set_exclusive_bitmap(fs);
+    if (fs->fat_bits == 32)
+        de.starthi = CT_LE_W(start >> 16);
 
-    /* TODO: below 'for' loop can be moved into after find_start_clusters() 'for' loop */
-    /* check if orphan cluster chain has normal cluster.
-     * if then, set EOF to orphan cluster's value. */
-    for (i = FAT_START_ENT; i < max_clus_num; i++) {
-        uint32_t value;
+    set_bitmap_reclaim(fs, start);
 
-        /* check 64bit at once */
-        if (i % BITS_PER_LONG == 0 && fs->real_bitmap[i / BITS_PER_LONG] == 0) {
-            i = ((i / BITS_PER_LONG) * BITS_PER_LONG) + BITS_PER_LONG - 1;
-            continue;
-        }
+    if (list) {
+        printf("Reclaimed file %s, start cluster(%d)\n",
+                file_name((unsigned char *)de.name), start);
+    }
 
-        /* if bit is set, that cluster is orphan cluster */
-        if (!test_bit(i, fs->real_bitmap)) {
-            continue;
-        }
+    /* check circular/shared cluster chain */
+    clus_cnt = 1;
+    prev = start;
+    for (walk = next_cluster(fs, start);
+            walk > 0 && walk < max_clus_num;
+            walk = next_cluster(fs, walk)) {
 
-        next = __next_cluster(fs, i);
-        if (next > 0 && next < max_clus_num) {
-            get_fat(fs, next, &value);
-            /* In case that i's next cluster is already in other cluster chain
-             * or i's next cluster has wrong cluster value */
-            if (!test_bit(next, fs->real_bitmap) ||
-                    test_bit(next, fs->bitmap) ||
-                    !value || FAT_IS_BAD(fs, value))
-                set_fat(fs, i, -1);
+        if (bitmap_test_bit(fs->real_bitmap, walk)) {
+            printf("WARNING: there should be not exist set bit of real_bitmap"
+                    " on reclaim cluster chain.\n");
         }
-    }
 
-    /* bitmap : zero cleared for reclaimed cluster */
-    memset(fs->bitmap, 0, fs->bitmap_size);
+        if (bitmap_test_bit(fs->bitmap, walk)) {
+            set_fat(fs, prev, -1);
+            break;
+        }
+        prev = walk;
+        clus_cnt++;
 
-    /* after find_start_clusters(),
-     * real_bitmap represent orphan's start cluster */
-    find_start_clusters(fs);
+        set_bitmap_reclaim(fs, walk);
+    }
 
-    files = reclaimed = 0;
-    for (i = FAT_START_ENT; i < max_clus_num; i++) {
-        /* TODO: can check 64bit at once? */
-        if (fs->real_bitmap[i / BITS_PER_LONG] == 0) {
-            i = ((i / BITS_PER_LONG) * BITS_PER_LONG) + BITS_PER_LONG - 1;
-            continue;
-        }
+    de.size = CT_LE_L(clus_cnt * fs->cluster_size);
 
-        /* check real_bitmap, and if it set,
-         * it(i) is orphaned cluster's start cluster */
-        if (test_bit(i, fs->real_bitmap)) {
-            DIR_ENT de;
-            loff_t offset;
-            uint32_t clus_cnt;
-            uint32_t prev;
+    de.time = CT_LE_W((unsigned short)((ctime->tm_sec >> 1) +
+                (ctime->tm_min << 5) + (ctime->tm_hour << 11)));
+    de.date = CT_LE_W((unsigned short)(ctime->tm_mday +
+                ((ctime->tm_mon + 1) << 5) +
+                ((ctime->tm_year - 80) << 9)));
+    de.ctime_ms = 0;
+    de.ctime = de.time;
+    de.cdate = de.date;
+    de.adate = de.date;
 
-            files++;
-            if (fs->root_cluster)
-                offset = alloc_reclaimed_entry(fs, &de, "FSCK%04dREC");
-            else
-                offset = alloc_rootdir_entry(fs, &de, "FSCK%04dREC");
+    fs_write(offset, sizeof(DIR_ENT), &de);
 
-            de.start = CT_LE_W(i & 0xffff);
+    return clus_cnt;
+}
 
-            if (fs->fat_bits == 32)
-                de.starthi = CT_LE_W(i >> 16);
+void reclaim_file(DOS_FS *fs)
+{
+    int reclaimed, files;
+    uint32_t i, prev, next;
+    BITMAP *pred;
+    struct tm *ctime;
+    time_t current;
 
-            set_bitmap_reclaim(fs, i);
+    time(&current);
+    ctime = localtime(&current);
 
-            if (list) {
-                printf("Reclaimed file %s, start cluster(%d)\n",
-                        file_name((unsigned char *)de.name), i);
-            }
+    if (verbose)
+        printf("Reclaiming unconnected clusters.\n");
 
-            /* check circular/shared cluster chain */
-            clus_cnt = 1;
-            prev = i;
-            for (walk = next_cluster(fs, i);
-                    walk > 0 && walk < max_clus_num;
-                    walk = next_cluster(fs, walk)) {
+    /* Remove checked cluster bits. After function called,
+     * remained bit in real_bitmap represent orphan clusters.
+     * And bitmap preserves previous real_bitmap */
+    set_exclusive_bitmap(fs);
 
-                if (test_bit(walk, fs->real_bitmap)) {
-                    printf("WARNING: there should be not exist set bit of real_bitmap"
-                            " on reclaim cluster chain.\n");
-                }
+    pred = alloc_cluster_bitmap(fs);
 
-                if (test_bit(walk, fs->bitmap)) {
-                    set_fat(fs, prev, -1);
-                    break;
-                }
-                prev = walk;
-                clus_cnt++;
+    /* after find_start_clusters(),
+     * real_bitmap represent orphan's start cluster */
+    find_start_clusters(fs, pred);
 
-                set_bitmap_reclaim(fs, walk);
-            }
+    /* bitmap : zero cleared for reclaimed cluster */
+    bitmap_zero(fs->bitmap);
 
-            de.size = CT_LE_L(clus_cnt * fs->cluster_size);
+    files = reclaimed = 0;
+    /* set bit of real_bitmap is orphaned cluster's start cluster */
+    for_each_bitmap_set(i, FAT_START_ENT, max_clus_num, fs->real_bitmap) {
+        files++;
+        reclaimed += reclaim_chain(fs, i, ctime);
+    }
 
-            de.time = CT_LE_W((unsigned short)((ctime->tm_sec >> 1) +
-                        (ctime->tm_min << 5) + (ctime->tm_hour << 11)));
-            de.date = CT_LE_W((unsigned short)(ctime->tm_mday +
-                        ((ctime->tm_mon + 1) << 5) +
-                        ((ctime->tm_year - 80) << 9)));
-            de.ctime_ms = 0;
-            de.ctime = de.time;
-            de.cdate = de.date;
-            de.adate = de.date;
+    /* Orphan clusters not reached from start clusters are in cycles.
+     * Cut each cycle before its lowest cluster and reclaim it from there. */
+    for_each_bitmap_set(i, FAT_START_ENT, max_clus_num, pred) {
+        if (bitmap_test_bit(fs->bitmap, i))
+            continue;
 
-            reclaimed += clus_cnt;
+        for (prev = i; (next = next_cluster(fs, prev)) != i; prev = next)
+            ;
+        set_fat(fs, prev, -1);
 
-            fs_write(offset, sizeof(DIR_ENT), &de);
-        }
+        files++;
+        reclaimed += reclaim_chain(fs, i, ctime);
     }
 
+    free_bitmap(pred);
+
     if (reclaimed)
         printf("Reclaimed %d unused cluster%s (%llu bytes) in %d chain%s.\n",
                 reclaimed, reclaimed == 1 ? "" : "s",
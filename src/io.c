@@ -16,85 +16,732 @@
 
 /* Copyright (c) 2022-2026 LG Electronics Inc. */
 
-#ifdef CONFIG_SYNC_FILE_RANGE
-#define _GNU_SOURCE
-#include <fcntl.h>
-#endif
+#include "config.h"
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <stddef.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <linux/fd.h>
 
 #include "dosfsck.h"
 #include "common.h"
+#include "iodev.h"
 #include "io.h"
 
+/*
+ * Pending changes are kept in a skiplist ordered by pos. Changes never
+ * overlap each other, so they are ordered by their end offset as well and
+ * the level 0 chain (next[0]) is the sorted list of all changes.
+ */
+#define CHANGE_MAX_LEVEL    16
+#define CHANGE_SEED         0x2545f491  /* fixed, so that runs are reproducible */
+
 typedef struct _change {
-    void *data;
+    void *data;         /* NULL if spilled */
+    loff_t spill;       /* position in scratch file if spilled */
     loff_t pos;
     int size;
-    struct _change *next;
+    int level;
+    struct _change *next[];
 } CHANGE;
 
-static CHANGE *changes, *last;
-static int fd, did_change = 0;
+/*
+ * Data of pending changes is kept in memory up to change_limit bytes, data
+ * of further changes is spilled to a scratch file and read from it when
+ * needed. Space of dropped changes is kept as holes sorted by position,
+ * merged with their neighbours and reused first fit. The file is emptied
+ * when all changes are dropped.
+ */
+#define SCRATCH_TEMPLATE    "/dosfsck.XXXXXX"
+
+typedef struct _scratch_hole {
+    loff_t pos;
+    loff_t size;
+    struct _scratch_hole *next;
+} SCRATCH_HOLE;
+
+/*
+ * Journal: before changes are written, they are saved to the journal file
+ * in order of position, with a checksum over the header and all records.
+ * It is marked committed after the written data is durable. A journal
+ * which is not committed is written again to the device by
+ * fs_replay_journal(), unless its checksum shows it is incomplete.
+ */
+#define JOURNAL_MAGIC       "dosfsjnl"
+#define JOURNAL_VERSION     1
+#define JOURNAL_PENDING     1
+#define JOURNAL_COMMITTED   2
+#define JOURNAL_BUF         (64 * 1024)
+
+typedef struct journal_head {
+    char magic[8];
+    uint32_t version;
+    uint32_t state;     /* not in checksum, it is updated in place */
+    uint32_t clean;     /* non-zero if file system is consistent after */
+    uint32_t count;     /* number of records */
+    uint64_t dev_id;    /* device number, or inode of image file */
+    uint64_t dev_size;
+    uint64_t sum;
+} JOURNAL_HEAD;
+
+/* followed by 'size' bytes of data */
+typedef struct journal_rec {
+    uint64_t pos;
+    uint32_t size;
+    uint32_t pad;
+} JOURNAL_REC;
+
+/*
+ * Read cache: device blocks of CACHE_BLOCK_SIZE bytes, aligned to the
+ * block size, replaced with CLOCK algorithm. It holds only the data on the
+ * device, pending changes are applied over it by fs_find_data_copy().
+ */
+#define CACHE_BLOCK_SIZE    4096
+#define CACHE_NONE          (-1)
+#define CACHE_MAX_RUN       32  /* max blocks read by one syscall */
+#define PREFETCH_MAX_REQS   64  /* max requests of one fs_prefetch */
+
+/*
+ * Write back: changes are coalesced into runs aligned to FLUSH_PAGE_SIZE,
+ * gaps between them are filled with data on the device. Runs are written
+ * with pwritev in ascending order, FATs first, then root directory and data
+ * area, then other reserved sectors and the boot sector last. Each area is
+ * completed before the next one.
+ */
+#define FLUSH_PAGE_SIZE     4096
+#define FLUSH_MAX_RUN       (1024 * 1024)   /* unless a change is bigger */
+#define FLUSH_MAX_IOV       256
+#define FLUSH_BATCH         64  /* runs written at once */
+
+typedef struct flush_run {
+    loff_t pos;
+    loff_t end;
+    CHANGE *first;
+    CHANGE *last;
+    struct iovec *iov;
+    int cnt;
+    char *buf;          /* device data between changes and spilled data */
+    int buf_size;
+} FLUSH_RUN;
+
+/*
+ * Durability: ranges written since the last sync are kept sorted and
+ * merged, and only they are written back. Device cache is flushed only
+ * by fs_barrier(), before the boot sector is written or the dirty flag is
+ * cleaned so that the flag can't be durable before the repairs, and when
+ * closing the device.
+ */
+#define DIRTY_MAX_RANGES    64  /* more are merged into neighbours */
+
+typedef struct dirty_range {
+    loff_t start;
+    loff_t end;
+} DIRTY_RANGE;
+
+typedef struct _cache_block {
+    loff_t blk;     /* block number, CACHE_NONE if unused */
+    int len;        /* valid bytes, shorter than block size at device end */
+    int ref;        /* referenced bit for CLOCK */
+    int hnext;      /* next block in hash chain */
+    char *data;
+} CACHE_BLOCK;
+
+typedef struct {
+    CACHE_BLOCK *blocks;
+    int *hash;
+    char *mem;
+    int nblocks;
+    int hash_mask;
+    int hand;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long prefetched;
+} BLOCK_CACHE;
+
+static BLOCK_CACHE cache;
+static long long cache_size = FS_CACHE_SIZE;
+
+static CHANGE *changes[CHANGE_MAX_LEVEL];
+static int change_level;
+static unsigned int change_seed;
+static IO_DEV *dev;
+static char *backend = IO_DEFAULT_BACKEND;
+static int did_change = 0;
 static off_t dev_size;
+static loff_t fat_start = SECTOR_SIZE;
+static loff_t fat_end = SECTOR_SIZE;
+static unsigned long flush_changes;
+static unsigned long flush_writes;
+static unsigned long long flush_bytes;
+static long long change_limit = FS_CHANGE_SIZE;
+static long long change_mem;    /* bytes of changes in memory */
+static char *scratch_dir;       /* NULL for TMPDIR or /tmp */
+static int scratch_fd = -1;
+static loff_t scratch_end;
+static SCRATCH_HOLE *scratch_holes;
+static unsigned long long spill_bytes;
+static char *journal_path;
+static FILE *journal;       /* open until committed */
+static int write_failed;
+static uint64_t dev_id;
+static DIRTY_RANGE dirty[DIRTY_MAX_RANGES];
+static int ndirty;
+static int unflushed;   /* written back, but may be in device cache */
 
 unsigned device_no;
 
-#ifdef __DJGPP__
-#include "volume.h"	/* DOS lowlevel disk access functions */
-#undef llseek
-static loff_t llseek(int fd, loff_t offset, int whence)
+void fs_set_cache_size(long long size)
+{
+    cache_size = size;
+}
+
+void fs_set_backend(char *name)
+{
+    backend = name;
+}
+
+void fs_set_change_limit(long long size)
+{
+    change_limit = size;
+}
+
+void fs_set_scratch_dir(char *path)
+{
+    scratch_dir = path;
+}
+
+void fs_set_journal(char *path)
+{
+    journal_path = path;
+}
+
+void fs_set_layout(loff_t start, loff_t end)
+{
+    /* areas of __fs_flush() should not overlap */
+    fat_start = start > SECTOR_SIZE ? start : SECTOR_SIZE;
+    fat_end = end > fat_start ? end : fat_start;
+}
+
+static void init_cache(void)
+{
+    long long nblocks;
+    int i;
+
+    memset(&cache, 0, sizeof(cache));
+
+    /* no need to be bigger than device */
+    nblocks = cache_size / CACHE_BLOCK_SIZE;
+    if (nblocks > dev_size / CACHE_BLOCK_SIZE + 1)
+        nblocks = dev_size / CACHE_BLOCK_SIZE + 1;
+
+    cache.nblocks = nblocks;
+    if (cache.nblocks < 2) {
+        cache.nblocks = 0;
+        return;
+    }
+
+    for (i = 1; i < cache.nblocks * 2; i <<= 1)
+        ;
+    cache.hash_mask = i - 1;
+
+    cache.blocks = alloc_mem(cache.nblocks * sizeof(CACHE_BLOCK));
+    cache.hash = alloc_mem(i * sizeof(int));
+    cache.mem = alloc_mem(cache.nblocks * CACHE_BLOCK_SIZE);
+
+    for (i = 0; i <= cache.hash_mask; i++)
+        cache.hash[i] = CACHE_NONE;
+
+    for (i = 0; i < cache.nblocks; i++) {
+        cache.blocks[i].blk = CACHE_NONE;
+        cache.blocks[i].hnext = CACHE_NONE;
+        cache.blocks[i].data = cache.mem + (long)i * CACHE_BLOCK_SIZE;
+    }
+}
+
+static void free_cache(void)
 {
-    if ((whence != SEEK_SET) || (fd == 4711))
-        return -1; /* only those supported */
-    return VolumeSeek(offset);
+    free_mem(cache.mem);
+    free_mem(cache.hash);
+    free_mem(cache.blocks);
+    memset(&cache, 0, sizeof(cache));
+}
+
+static CACHE_BLOCK *lookup_cache(loff_t blk)
+{
+    int i;
+
+    for (i = cache.hash[blk & cache.hash_mask]; i != CACHE_NONE;
+            i = cache.blocks[i].hnext) {
+        if (cache.blocks[i].blk == blk)
+            return &cache.blocks[i];
+    }
+
+    return NULL;
+}
+
+/* Evict a block by CLOCK algorithm and make it hold 'blk' */
+static CACHE_BLOCK *replace_cache(loff_t blk)
+{
+    CACHE_BLOCK *this;
+    int *link;
+    int i;
+
+    for (;;) {
+        i = cache.hand;
+        cache.hand = (cache.hand + 1) % cache.nblocks;
+        this = &cache.blocks[i];
+        if (!this->ref)
+            break;
+        this->ref = 0;
+    }
+
+    if (this->blk != CACHE_NONE) {
+        for (link = &cache.hash[this->blk & cache.hash_mask];
+                *link != i; link = &cache.blocks[*link].hnext)
+            ;
+        *link = this->hnext;
+    }
+
+    this->blk = blk;
+    this->ref = 1;
+    this->hnext = cache.hash[blk & cache.hash_mask];
+    cache.hash[blk & cache.hash_mask] = i;
+
+    return this;
+}
+
+static void drop_cache(CACHE_BLOCK *this)
+{
+    int *link;
+    int i = this - cache.blocks;
+
+    for (link = &cache.hash[this->blk & cache.hash_mask];
+            *link != i; link = &cache.blocks[*link].hnext)
+        ;
+    *link = this->hnext;
+
+    this->blk = CACHE_NONE;
+    this->hnext = CACHE_NONE;
+    this->ref = 0;
+}
+
+/* Set valid bytes of 'cnt' blocks in 'run' from 'got' bytes read into them,
+ * blocks not read are dropped */
+static void fill_run(CACHE_BLOCK **run, int cnt, ssize_t got)
+{
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+        if (got <= 0) {
+            drop_cache(run[i]);
+            continue;
+        }
+
+        run[i]->len = got < CACHE_BLOCK_SIZE ? got : CACHE_BLOCK_SIZE;
+        got -= run[i]->len;
+    }
+}
+
+/* Read missing blocks from 'blk' to 'end' (excluding) into cache at once.
+ * Returns 0 if the device could not be read. */
+static int fill_cache(loff_t blk, loff_t end)
+{
+    struct iovec iov[CACHE_MAX_RUN];
+    CACHE_BLOCK *run[CACHE_MAX_RUN];
+    ssize_t got;
+    int max_run;
+    int cnt;
+
+    /* not to evict the blocks of this run while filling it */
+    max_run = min(CACHE_MAX_RUN, max(cache.nblocks / 2, 1));
+
+    for (cnt = 0; blk + cnt < end && cnt < max_run; cnt++) {
+        if (lookup_cache(blk + cnt))
+            break;
+
+        run[cnt] = replace_cache(blk + cnt);
+        iov[cnt].iov_base = run[cnt]->data;
+        iov[cnt].iov_len = CACHE_BLOCK_SIZE;
+    }
+
+    got = io_preadv(dev, iov, cnt, blk * CACHE_BLOCK_SIZE);
+    fill_run(run, cnt, got);
+    cache.misses += cnt;
+
+    return run[0]->blk != CACHE_NONE;
+}
+
+void fs_prefetch(loff_t *pos, int cnt, int size)
+{
+    IO_REQ reqs[PREFETCH_MAX_REQS];
+    struct iovec *iov;
+    CACHE_BLOCK **run;
+    loff_t blk, end;
+    loff_t next = CACHE_NONE;   /* block continuing the last request */
+    int nreqs = 0;
+    int nblocks = 0;
+    int budget;
+    int first;
+    int i;
+
+    /* same as fs_read, big reads don't use cache */
+    if (size > cache.nblocks * CACHE_BLOCK_SIZE / 4)
+        return;
+
+    /* not to evict the blocks of this prefetch while filling it */
+    budget = cache.nblocks / 2;
+    iov = alloc_mem(budget * sizeof(struct iovec));
+    run = alloc_mem(budget * sizeof(CACHE_BLOCK *));
+
+    for (i = 0; i < cnt && nblocks < budget; i++) {
+        blk = pos[i] / CACHE_BLOCK_SIZE;
+        end = (pos[i] + size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+
+        for (; blk < end && nblocks < budget; blk++) {
+            if (lookup_cache(blk)) {
+                next = CACHE_NONE;
+                continue;
+            }
+
+            if (blk != next || reqs[nreqs - 1].cnt == CACHE_MAX_RUN) {
+                if (nreqs == PREFETCH_MAX_REQS)
+                    break;
+
+                reqs[nreqs].write = 0;
+                reqs[nreqs].iov = &iov[nblocks];
+                reqs[nreqs].cnt = 0;
+                reqs[nreqs].pos = blk * CACHE_BLOCK_SIZE;
+                nreqs++;
+            }
+
+            run[nblocks] = replace_cache(blk);
+            iov[nblocks].iov_base = run[nblocks]->data;
+            iov[nblocks].iov_len = CACHE_BLOCK_SIZE;
+            reqs[nreqs - 1].cnt++;
+            nblocks++;
+            next = blk + 1;
+        }
+    }
+
+    if (io_submit(dev, reqs, nreqs) < 0) {
+        for (i = 0; i < nreqs; i++)
+            reqs[i].res = -EIO;
+    }
+
+    for (i = 0, first = 0; i < nreqs; first += reqs[i].cnt, i++)
+        fill_run(&run[first], reqs[i].cnt, reqs[i].res);
+
+    cache.misses += nblocks;
+    cache.prefetched += nblocks;
+
+    free_mem(run);
+    free_mem(iov);
+}
+
+/* Copy data from cache. Returns 0 if any part of it can't be read,
+ * then caller should read it from device directly. */
+static int read_cache(loff_t pos, int size, void *data)
+{
+    CACHE_BLOCK *this;
+    loff_t blk;
+    loff_t end;
+    int offset;
+    int len;
+
+    blk = pos / CACHE_BLOCK_SIZE;
+    end = (pos + size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+
+    while (size > 0) {
+        this = lookup_cache(blk);
+        if (this) {
+            cache.hits++;
+        }
+        else {
+            if (!fill_cache(blk, end))
+                return 0;
+            this = lookup_cache(blk);
+        }
+        this->ref = 1;
+
+        offset = pos - blk * CACHE_BLOCK_SIZE;
+        len = min(size, CACHE_BLOCK_SIZE - offset);
+        if (offset + len > this->len)
+            return 0;
+
+        memcpy(data, this->data + offset, len);
+        data = (char *)data + len;
+        pos += len;
+        size -= len;
+        blk++;
+    }
+
+    return 1;
+}
+
+/* Keep cached blocks same as the device after writing to it */
+static void update_cache(loff_t pos, int size, void *data)
+{
+    CACHE_BLOCK *this;
+    loff_t blk;
+    int offset;
+    int len;
+
+    if (!cache.nblocks)
+        return;
+
+    for (blk = pos / CACHE_BLOCK_SIZE; size > 0; blk++) {
+        offset = pos - blk * CACHE_BLOCK_SIZE;
+        len = min(size, CACHE_BLOCK_SIZE - offset);
+
+        this = lookup_cache(blk);
+        if (this) {
+            if (offset + len <= this->len)
+                memcpy(this->data + offset, data, len);
+            else
+                drop_cache(this);
+        }
+
+        data = (char *)data + len;
+        pos += len;
+        size -= len;
+    }
+}
+
+void fs_print_cache(void)
+{
+    printf("Read cache : %d blocks, %lu hits, %lu misses, %lu prefetched\n",
+            cache.nblocks, cache.hits, cache.misses, cache.prefetched);
 }
-#define open OpenVolume
-#define close CloseVolume
-#define read(a,b,c) ReadVolume(b,c)
-#define write(a,b,c) WriteVolume(b,c)
-#endif
 
 void fs_open(char *path, int rw)
 {
     struct stat stbuf;
 
-    if ((fd = open(path, (rw ? O_RDWR : O_RDONLY) | O_EXCL)) < 0)
-        pdie("open %s", path);
+    dev = io_open(backend, path, (rw ? O_RDWR : O_RDONLY) | O_EXCL);
 
-    changes = last = NULL;
+    memset(changes, 0, sizeof(changes));
+    change_level = 0;
+    change_seed = CHANGE_SEED;
     did_change = 0;
 
-#ifndef _DJGPP_
-    if (fstat(fd, &stbuf) < 0)
+    if (fstat(dev->fd, &stbuf) < 0)
         pdie("fstat %s", path);
 
     device_no = S_ISBLK(stbuf.st_mode) ? (stbuf.st_rdev >> 8) & 0xff : 0;
-#else
-    if (IsWorkingOnImageFile()) {
-        if (fstat(GetVolumeHandle(), &stbuf) < 0)
-            pdie("fstat image %s", path);
-        device_no = 0;
-    }
-    else {
-        /* return 2 for floppy, 1 for ramdisk, 7 for loopback  */
-        /* used by boot.c in Atari mode: floppy always FAT12,  */
-        /* loopback / ramdisk only FAT12 if usual floppy size, */
-        /* harddisk always FAT16 on Atari... */
-        device_no = (GetVolumeHandle() < 2) ? 2 : 1;
-        /* telling "floppy" for A:/B:, "ramdisk" for the rest */
-    }
-#endif
-    dev_size = lseek(fd, 0, SEEK_END);
+    dev_id = S_ISBLK(stbuf.st_mode) ? stbuf.st_rdev : stbuf.st_ino;
+
+    dev_size = io_size(dev);
     if (dev_size <= 0)
         pdie("Can't get device size\n");
+
+    init_cache();
+}
+
+/* Pick a level for a new change: level n+1 with probability 1/4 of level n */
+static int change_random_level(void)
+{
+    int level = 1;
+
+    /* xorshift32 */
+    change_seed ^= change_seed << 13;
+    change_seed ^= change_seed >> 17;
+    change_seed ^= change_seed << 5;
+
+    while (level < CHANGE_MAX_LEVEL &&
+            !((change_seed >> (2 * (level - 1))) & 3))
+        level++;
+
+    return level;
+}
+
+/* Find the first change which ends after 'pos'.
+ * If 'update' is not NULL, the link to be updated on each level
+ * for inserting or deleting before that change is stored in it. */
+static CHANGE *find_change(loff_t pos, CHANGE ***update)
+{
+    CHANGE **next = changes;
+    CHANGE *walk;
+    int i;
+
+    for (i = change_level - 1; i >= 0; i--) {
+        while ((walk = next[i]) && walk->pos + walk->size <= pos)
+            next = walk->next;
+
+        if (update)
+            update[i] = &next[i];
+    }
+
+    return next[0];
+}
+
+/* Create scratch file, which is removed when closed.
+ * Returns 0 if it can't be created in default directory. */
+static int open_scratch(void)
+{
+    char *dir = scratch_dir;
+    char *path;
+
+    if (!dir)
+        dir = getenv("TMPDIR");
+    if (!dir)
+        dir = "/tmp";
+
+    path = alloc_mem(strlen(dir) + sizeof(SCRATCH_TEMPLATE));
+    sprintf(path, "%s" SCRATCH_TEMPLATE, dir);
+    scratch_fd = mkstemp(path);
+    if (scratch_fd >= 0)
+        unlink(path);
+    free_mem(path);
+
+    if (scratch_fd < 0) {
+        if (scratch_dir)
+            pdie("Can't create scratch file in %s", dir);
+        fprintf(stderr, "Can't create scratch file in %s: %s\n"
+                "  Keeping all changes in memory\n", dir, strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+static void scratch_io(int write, void *data, int size, loff_t pos)
+{
+    ssize_t did;
+
+    while (size > 0) {
+        if (write)
+            did = pwrite(scratch_fd, data, size, pos);
+        else
+            did = pread(scratch_fd, data, size, pos);
+
+        if (did < 0) {
+            if (errno == EINTR)
+                continue;
+            pdie("%s %d bytes at %lld of scratch file",
+                    write ? "Write" : "Read", size, (long long)pos);
+        }
+        if (did == 0)
+            die("Scratch file is shorter than %lld", (long long)pos);
+
+        data = (char *)data + did;
+        size -= did;
+        pos += did;
+    }
+}
+
+/* Copy 'size' bytes of 'change' at 'pos' of device to 'data' */
+static void get_change_data(CHANGE *change, loff_t pos, int size, void *data)
+{
+    if (change->data)
+        memcpy(data, (char *)change->data + (pos - change->pos), size);
+    else
+        scratch_io(0, data, size, change->spill + (pos - change->pos));
+}
+
+/* Returns position of 'size' bytes of free space in scratch file */
+static loff_t alloc_scratch(int size)
+{
+    SCRATCH_HOLE **link;
+    SCRATCH_HOLE *hole;
+    loff_t pos;
+
+    for (link = &scratch_holes; (hole = *link); link = &hole->next) {
+        if (hole->size < size)
+            continue;
+
+        pos = hole->pos;
+        hole->pos += size;
+        hole->size -= size;
+        if (!hole->size) {
+            *link = hole->next;
+            free_mem(hole);
+        }
+        return pos;
+    }
+
+    pos = scratch_end;
+    scratch_end += size;
+    return pos;
+}
+
+/* Give back 'size' bytes at 'pos' of scratch file */
+static void free_scratch(loff_t pos, int size)
+{
+    SCRATCH_HOLE **link = &scratch_holes;
+    SCRATCH_HOLE **prev = NULL;     /* link to the hole before 'pos' */
+    SCRATCH_HOLE *hole;
+    SCRATCH_HOLE *next;
+
+    while ((hole = *link) && hole->pos < pos) {
+        prev = link;
+        link = &hole->next;
+    }
+
+    if (prev && (*prev)->pos + (*prev)->size == pos) {
+        link = prev;
+        hole = *link;
+        hole->size += size;
+    }
+    else {
+        hole = alloc_mem(sizeof(SCRATCH_HOLE));
+        hole->pos = pos;
+        hole->size = size;
+        hole->next = *link;
+        *link = hole;
+    }
+
+    next = hole->next;
+    if (next && hole->pos + hole->size == next->pos) {
+        hole->size += next->size;
+        hole->next = next->next;
+        free_mem(next);
+    }
+
+    /* the hole at the end is the last one, shrink the file instead */
+    if (hole->pos + hole->size == scratch_end) {
+        scratch_end = hole->pos;
+        *link = NULL;
+        free_mem(hole);
+    }
+}
+
+static void free_scratch_holes(void)
+{
+    SCRATCH_HOLE *next;
+
+    while (scratch_holes) {
+        next = scratch_holes->next;
+        free_mem(scratch_holes);
+        scratch_holes = next;
+    }
+}
+
+/* Account data of new 'change', spill it if memory limit is exceeded */
+static void keep_change(CHANGE *change)
+{
+    if (change_mem + change->size <= change_limit) {
+        change_mem += change->size;
+        return;
+    }
+
+    if (scratch_fd < 0 && !open_scratch()) {
+        change_limit = LLONG_MAX;
+        change_mem += change->size;
+        return;
+    }
+
+    change->spill = alloc_scratch(change->size);
+    scratch_io(1, change->data, change->size, change->spill);
+    spill_bytes += change->size;
+
+    free_mem(change->data);
+    change->data = NULL;
 }
 
 /* Find whether data in position has modified on CHANGE list,
@@ -102,29 +749,38 @@ void fs_open(char *path, int rw)
 void fs_find_data_copy(loff_t pos, int size, void *data)
 {
     CHANGE *walk;
+    loff_t start;
+    loff_t end;
 
-    for (walk = changes; walk; walk = walk->next) {
-        if (pos + size < walk->pos) {
+    for (walk = find_change(pos, NULL); walk; walk = walk->next[0]) {
+        if (walk->pos >= pos + size)
             break;
-        }
 
-        /* in case that new read area overlap with previous read data */
-        if (walk->pos < pos + size && walk->pos + walk->size > pos) {
-            if (walk->pos < pos)
-                memcpy(data, (char *)walk->data + pos - walk->pos,
-                        min(size, walk->size - pos + walk->pos));
-            else
-                memcpy((char *)data + walk->pos - pos, walk->data,
-                        min(walk->size, size + pos - walk->pos));
-        }
+        /* copy only overlapped area */
+        start = walk->pos > pos ? walk->pos : pos;
+        end = walk->pos + walk->size < pos + size ?
+            walk->pos + walk->size : pos + size;
+        get_change_data(walk, start, end - start, (char *)data + (start - pos));
     }
 }
 
 void fs_read(loff_t pos, int size, void *data)
+{
+    /* big reads (e.g. FAT) bypass cache not to evict all the others */
+    if (size <= cache.nblocks * CACHE_BLOCK_SIZE / 4 &&
+            read_cache(pos, size, data)) {
+        fs_find_data_copy(pos, size, data);
+        return;
+    }
+
+    fs_pread(pos, size, data);
+}
+
+void fs_pread(loff_t pos, int size, void *data)
 {
     int got;
 
-    if ((got = pread(fd, data, size, pos)) < 0)
+    if ((got = io_pread(dev, data, size, pos)) < 0)
         die("Got %d bytes instead of %d at %lld(%d,%s)",
                 got, size, pos, __LINE__, __func__);
 
@@ -141,81 +797,59 @@ int fs_test(loff_t pos, int size)
     int okay;
 
     scratch = alloc_mem(size);
-    okay = pread(fd, scratch, size, pos) == size;
+    okay = io_pread(dev, scratch, size, pos) == size;
     free_mem(scratch);
     return okay;
 }
 
-static CHANGE *merge_change(CHANGE *old, CHANGE *new)
+static CHANGE *alloc_change(loff_t pos, int size)
 {
-    CHANGE *merge;
-    int size;
-
-    merge = alloc_mem(sizeof(CHANGE));
+    CHANGE *new;
+    int level;
 
-    merge->pos = min(old->pos, new->pos);
-    merge->size = max(old->pos + old->size, new->pos + new->size) -
-        min(old->pos, new->pos);
-    merge->data = alloc_mem(merge->size);
+    level = change_random_level();
+    new = alloc_mem(sizeof(CHANGE) + level * sizeof(CHANGE *));
+    new->pos = pos;
+    new->size = size;
+    new->level = level;
+    new->data = alloc_mem(size);
 
-    /*
-     * new :         |--------|
-     * old : |----------|
-     */
-    if (merge->pos == old->pos) {
-        size = new->pos - old->pos;
-        memcpy(merge->data, old->data, size);
-        memcpy(merge->data + size, new->data, new->size);
-    }
-    /*
-     * new : |--------|
-     * old:        |----------|
-     */
-    else {
-        size = (old->pos + old->size) - (new->pos + new->size);
-        memcpy(merge->data, new->data, new->size);
-        memcpy(merge->data + new->size, old->data + (old->size - size), size);
-    }
-    return merge;
+    return new;
 }
 
 static void free_change(CHANGE *del)
 {
-    if (del) {
+    if (!del)
+        return;
+
+    if (del->data) {
+        change_mem -= del->size;
         free_mem(del->data);
-        free_mem(del);
     }
+    else
+        free_scratch(del->spill, del->size);
+
+    free_mem(del);
 }
 
-static void add_change_list(CHANGE *prev, CHANGE *new, CHANGE *next)
+static void free_change_list(void)
 {
-    if (prev) {
-        new->next = next;
-        prev->next = new;
-    }
-    else {
-        new->next = changes;
-        changes = new;
-    }
+    CHANGE *next;
 
-    if (!next) {
-        if (last == prev)
-            last = new;
+    while (changes[0]) {
+        next = changes[0]->next[0];
+        free_change(changes[0]);
+        changes[0] = next;
     }
-}
 
-static void del_change_list(CHANGE *prev, CHANGE *del)
-{
-    if (prev) {
-        prev->next = del->next;
-    }
-    else {
-        changes = del->next;
-    }
+    memset(changes, 0, sizeof(changes));
+    change_level = 0;
 
-    if (last == del) {
-        last = prev;
-    }
+    /* give space back, scratch file may be on tmpfs */
+    if (scratch_fd >= 0 && ftruncate(scratch_fd, 0) < 0)
+        pdie("Truncate scratch file");
+    scratch_end = 0;
+    free_scratch_holes();
 }
 
 void print_changes(void)
@@ -227,8 +861,8 @@ void print_changes(void)
 
     printf("Wrong data in CHANGES list : ");
 
-    for (i = 0, walk = changes; walk; walk = walk->next, i++) {
-        next = walk->next;
+    for (i = 0, walk = changes[0]; walk; walk = walk->next[0], i++) {
+        next = walk->next[0];
         if (!next) {
             break;
         }
@@ -244,12 +878,82 @@ void print_changes(void)
         printf("None\n");
 }
 
+/* Remember that 'start' to 'end' (excluding) is written */
+static void add_dirty(loff_t start, loff_t end)
+{
+    int i, j;
+
+    for (i = 0; i < ndirty && dirty[i].end < start; i++)
+        ;
+
+    /* ranges from i to j - 1 overlap or touch the new one */
+    for (j = i; j < ndirty && dirty[j].start <= end; j++) {
+        if (dirty[j].start < start)
+            start = dirty[j].start;
+        if (dirty[j].end > end)
+            end = dirty[j].end;
+    }
+
+    if (i == j) {
+        if (ndirty == DIRTY_MAX_RANGES) {
+            /* extend a neighbour, it does not reach others then */
+            if (i == ndirty)
+                i--;
+            if (dirty[i].start < start)
+                start = dirty[i].start;
+            if (dirty[i].end > end)
+                end = dirty[i].end;
+        }
+        else {
+            memmove(&dirty[i + 1], &dirty[i], (ndirty - i) * sizeof(*dirty));
+            ndirty++;
+        }
+    }
+    else {
+        memmove(&dirty[i + 1], &dirty[j], (ndirty - j) * sizeof(*dirty));
+        ndirty -= j - i - 1;
+    }
+
+    dirty[i].start = start;
+    dirty[i].end = end;
+}
+
+/* Write back dirty ranges and wait for them */
+static void sync_dirty(void)
+{
+    int i;
+
+    for (i = 0; i < ndirty; i++) {
+        if (io_sync(dev, dirty[i].start, dirty[i].end - dirty[i].start) < 0)
+            pdie("sync");
+    }
+
+    if (ndirty)
+        unflushed = 1;
+    ndirty = 0;
+}
+
+void fs_barrier(void)
+{
+    sync_dirty();
+
+    if (unflushed && io_barrier(dev) < 0)
+        pdie("sync");
+    unflushed = 0;
+}
+
 void fs_write_immed(loff_t pos, int size, void *data)
 {
     int did;
 
     did_change = 1;
-    if ((did = pwrite(fd, data, size, pos)) == size)
+    did = io_pwrite(dev, data, size, pos);
+    if (did > 0) {
+        update_cache(pos, did, data);
+        add_dirty(pos, pos + did);
+    }
+
+    if (did == size)
         return;
 
     if (did < 0)
@@ -258,212 +962,610 @@ void fs_write_immed(loff_t pos, int size, void *data)
     die("Wrote %d bytes instead of %d at %lld", did, size, pos);
 }
 
+/* Returns the end of the area of __fs_flush() that 'pos' is in */
+static loff_t area_end(loff_t pos)
+{
+    if (pos < SECTOR_SIZE)
+        return SECTOR_SIZE;
+    if (pos < fat_start)
+        return fat_start;
+    if (pos < fat_end)
+        return fat_end;
+    return dev_size;
+}
+
 void fs_write(loff_t pos, int size, void *data)
 {
+    CHANGE **update[CHANGE_MAX_LEVEL];
     CHANGE *new;
     CHANGE *walk;
-    CHANGE *prev;
-    CHANGE *merge;
+    CHANGE *next;
+    loff_t start;
+    loff_t end;
+    int i;
 
     if (write_immed) {
         fs_write_immed(pos, size, data);
         return;
     }
 
-    new = alloc_mem(sizeof(CHANGE));
-    new->pos = pos;
-    memcpy(new->data = alloc_mem(new->size = size), data, size);
-    new->next = NULL;
+    /* a change never crosses an area, so that each area is flushed as it is */
+    end = area_end(pos);
+    if (pos < end && pos + size > end) {
+        fs_write(pos, end - pos, data);
+        fs_write(end, pos + size - end, (char *)data + (end - pos));
+        return;
+    }
 
-    /* for first entry */
-    if (!last) {
-        changes = new;
-        last = new;
+    walk = find_change(pos, update);
+
+    /* new : |--------|
+     * walk: |----------------|
+     * -> use walk & copy new data */
+    if (walk && walk->pos <= pos && pos + size <= walk->pos + walk->size) {
+        if (walk->data)
+            memcpy((char *)walk->data + (pos - walk->pos), data, size);
+        else
+            scratch_io(1, data, size, walk->spill + (pos - walk->pos));
         return;
     }
 
-    prev = NULL;
-    for (walk = changes; walk; prev = walk, walk = walk->next) {
-        if (pos >= walk->pos + walk->size) {
-            CHANGE *next;
-            /* new  :           |--------|
-             * walk : |--------|
-             * Include when walk is last entry of list.
-             * -> add new */
-            next = walk->next;
-            if (!next || ((pos + size) <= next->pos)) {
-                add_change_list(walk, new, next);
-                break;
-            }
-            continue;
+    /* new :      |--------------------|
+     * walk: |--------|   |-----|   |--------|
+     * -> merge all overlapped changes to new & delete them.
+     * Data of new has priority over the data of walk. */
+    start = pos;
+    end = pos + size;
+    if (walk && walk->pos < start)
+        start = walk->pos;
+
+    for (next = walk; next && next->pos < pos + size; next = next->next[0]) {
+        if (next->pos + next->size > end)
+            end = next->pos + next->size;
+    }
+
+    new = alloc_change(start, end - start);
+    memcpy((char *)new->data + (pos - start), data, size);
+
+    for (; walk && walk->pos < pos + size; walk = next) {
+        next = walk->next[0];
+
+        if (walk->pos < pos)
+            get_change_data(walk, walk->pos, pos - walk->pos, new->data);
+
+        if (walk->pos + walk->size > pos + size)
+            get_change_data(walk, pos + size,
+                    walk->pos + walk->size - (pos + size),
+                    (char *)new->data + (pos + size - start));
+
+        for (i = 0; i < walk->level; i++)
+            *update[i] = walk->next[i];
+
+        free_change(walk);
+    }
+
+    /* link new change on each level */
+    for (i = change_level; i < new->level; i++)
+        update[i] = &changes[i];
+
+    if (new->level > change_level)
+        change_level = new->level;
+
+    for (i = 0; i < new->level; i++) {
+        new->next[i] = *update[i];
+        *update[i] = new;
+    }
+
+    /* after merged ones are freed, so that their scratch space is reused */
+    keep_change(new);
+}
+
+/* Read data on the device without changes */
+static int read_device(loff_t pos, int size, void *data)
+{
+    if (size <= cache.nblocks * CACHE_BLOCK_SIZE / 4 &&
+            read_cache(pos, size, data))
+        return 1;
+
+    return io_pread(dev, data, size, pos) == size;
+}
+
+/* Set up iovecs of 'run' from its changes and gaps between them.
+ * Returns 0 if gaps could not be read. */
+static int build_run(FLUSH_RUN *run)
+{
+    CHANGE *walk;
+    loff_t pos;
+    int cnt;
+    char *buf;
+
+    run->buf_size = run->end - run->pos;
+    cnt = 1;
+    for (walk = run->first; ; walk = walk->next[0]) {
+        if (walk->data)
+            run->buf_size -= walk->size;
+        cnt += 2;
+        if (walk == run->last)
+            break;
+    }
+
+    run->iov = alloc_mem(cnt * sizeof(struct iovec));
+    run->buf = run->buf_size ? alloc_mem(run->buf_size) : NULL;
+    run->cnt = 0;
+
+    buf = run->buf;
+    pos = run->pos;
+    for (walk = run->first; ; walk = walk->next[0]) {
+        if (walk->pos > pos) {
+            if (!read_device(pos, walk->pos - pos, buf))
+                return 0;
+
+            run->iov[run->cnt].iov_base = buf;
+            run->iov[run->cnt++].iov_len = walk->pos - pos;
+            buf += walk->pos - pos;
         }
 
-        /* new : |--------|
-         * walk:           |---------|
-         * Include walk is first entry of list.
-         * -> add new */
-        if (pos + size <= walk->pos) {
-            add_change_list(prev, new, walk);
+        if (walk->data)
+            run->iov[run->cnt].iov_base = walk->data;
+        else {
+            get_change_data(walk, walk->pos, walk->size, buf);
+            run->iov[run->cnt].iov_base = buf;
+            buf += walk->size;
+        }
+        run->iov[run->cnt++].iov_len = walk->size;
+        pos = walk->pos + walk->size;
+        if (walk == run->last)
             break;
+    }
+
+    if (run->end > pos) {
+        if (!read_device(pos, run->end - pos, buf))
+            return 0;
+
+        run->iov[run->cnt].iov_base = buf;
+        run->iov[run->cnt++].iov_len = run->end - pos;
+    }
+
+    return 1;
+}
+
+static void free_run(FLUSH_RUN *run)
+{
+    free_mem(run->iov);
+    free_mem(run->buf);
+    run->iov = NULL;
+    run->buf = NULL;
+}
+
+static void write_runs(FLUSH_RUN *runs, int cnt)
+{
+    IO_REQ reqs[FLUSH_BATCH];
+    CHANGE *walk;
+    loff_t pos;
+    int size;
+    int i, j;
+
+    for (i = 0; i < cnt; i++) {
+        reqs[i].write = 1;
+        reqs[i].iov = runs[i].iov;
+        reqs[i].cnt = runs[i].cnt;
+        reqs[i].pos = runs[i].pos;
+    }
+
+    if (io_submit(dev, reqs, cnt) < 0) {
+        for (i = 0; i < cnt; i++)
+            reqs[i].res = -errno;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        size = reqs[i].res;
+        if (size != runs[i].end - runs[i].pos)
+            write_failed = 1;
+        if (size < 0)
+            fprintf(stderr, "Writing %lld bytes at %lld failed: %s\n",
+                    (long long)(runs[i].end - runs[i].pos),
+                    (long long)runs[i].pos, strerror(-size));
+        else if (size != runs[i].end - runs[i].pos)
+            fprintf(stderr, "Wrote %d bytes instead of %lld bytes at %lld.\n",
+                    size, (long long)(runs[i].end - runs[i].pos),
+                    (long long)runs[i].pos);
+        if (size > 0)
+            add_dirty(runs[i].pos, runs[i].pos + size);
+
+        /* gaps are same as the cache, but simpler to update all */
+        for (j = 0, pos = runs[i].pos; j < runs[i].cnt && size > 0; j++) {
+            update_cache(pos, min(size, runs[i].iov[j].iov_len),
+                    runs[i].iov[j].iov_base);
+            pos += runs[i].iov[j].iov_len;
+            size -= runs[i].iov[j].iov_len;
         }
 
-        if (pos <= walk->pos) {
-            /* new : |-------------------------|
-             * walk:     |--------|      |--------|
-             * -> use new & delete walk */
-            if (pos + size >= walk->pos + walk->size) {
-                add_change_list(prev, new, walk);
-                del_change_list(new, walk);
-
-                free_change(walk);
-                /* walk->next's area also may be overlapped by new. Check next. */
-                if (new->next && new->next->pos < new->pos + new->size) {
-                    walk = new;
-                    continue;
-                }
-                break;
-            }
-            /* new : |--------|
-             * walk: |----------------|
-             * -> use walk & copy new data, delete new */
-            else if (pos == walk->pos) {
-                memcpy(walk->data, new->data, new->size);
-                free_change(new);
+        for (walk = runs[i].first; ; walk = walk->next[0]) {
+            flush_changes++;
+            if (walk == runs[i].last)
                 break;
-            }
-            /* new : |--------|
-             * walk:        |---------|
-             * -> merge & delete walk/new */
-            else {
-                merge = merge_change(walk, new);
-                add_change_list(prev, merge, walk);
-                del_change_list(merge, walk);
-
-                free_change(walk);
-                free_change(new);
-                break;
-            }
         }
-        else {
-            /* new :         |--------|
-             * walk: |----------|
-             * -> merge & delete walk/new */
-            if (pos + size > walk->pos + walk->size) {
-                merge = merge_change(walk, new);
-                add_change_list(prev, merge, walk);
-                del_change_list(merge, walk);
-
-                free_change(walk);
-                free_change(new);
-                break;
-            }
-            /* new :         |--------|
-             * walk: |-----------------|
-             * -> user walk & delete new */
-            else {
-                memcpy(walk->data + (pos - walk->pos), new->data, new->size);
-                free_change(new);
+        flush_writes++;
+        flush_bytes += runs[i].end - runs[i].pos;
+
+        free_run(&runs[i]);
+    }
+}
+
+/* Count the run just built at 'nruns', and write the batch when it is full
+ * or its buffers exceed memory limit. Returns new number of runs. */
+static int batch_run(FLUSH_RUN *runs, int nruns, long long *batch)
+{
+    *batch += runs[nruns++].buf_size;
+    if (nruns < FLUSH_BATCH && *batch <= change_limit)
+        return nruns;
+
+    write_runs(runs, nruns);
+    *batch = 0;
+    return 0;
+}
+
+static inline loff_t page_down(loff_t pos)
+{
+    return pos / FLUSH_PAGE_SIZE * FLUSH_PAGE_SIZE;
+}
+
+static inline loff_t page_up(loff_t pos)
+{
+    return page_down(pos + FLUSH_PAGE_SIZE - 1);
+}
+
+/* Write changes starting from 'start' to 'end' (excluding) */
+static void flush_area(loff_t start, loff_t end)
+{
+    FLUSH_RUN runs[FLUSH_BATCH];
+    FLUSH_RUN *run;
+    CHANGE *walk, *next;
+    CHANGE *first, *last;
+    loff_t limit = start;   /* end of last run */
+    long long batch = 0;    /* buffer bytes of runs */
+    int nruns = 0;
+    int iovs;
+
+    if (end > dev_size)
+        end = dev_size;
+
+    walk = find_change(start, NULL);
+    while (walk && walk->pos < start)
+        walk = walk->next[0];
+
+    while (walk && walk->pos < end) {
+        run = &runs[nruns];
+        run->first = walk;
+        run->pos = page_down(walk->pos);
+        if (run->pos < limit)
+            run->pos = limit;
+
+        /* take following changes in the same or the next page */
+        iovs = 3;
+        for (next = walk->next[0]; next && next->pos < end;
+                next = next->next[0]) {
+            if (page_down(next->pos) > page_up(walk->pos + walk->size) ||
+                    next->pos + next->size - run->pos > FLUSH_MAX_RUN ||
+                    iovs + 2 > FLUSH_MAX_IOV)
                 break;
+
+            walk = next;
+            iovs += 2;
+        }
+        run->last = walk;
+
+        /* padding should not cover the next change */
+        run->end = page_up(walk->pos + walk->size);
+        if (run->end > end)
+            run->end = end;
+        if (next && next->pos < run->end)
+            run->end = next->pos;
+        limit = run->end;
+
+        if (!build_run(run)) {
+            /* gaps can't be read, write each change as it is */
+            first = run->first;
+            last = run->last;
+            free_run(run);
+            for (walk = first; ; walk = walk->next[0]) {
+                run = &runs[nruns];
+                run->first = run->last = walk;
+                run->pos = walk->pos;
+                run->end = walk->pos + walk->size;
+                build_run(run);     /* never fails without gaps */
+                nruns = batch_run(runs, nruns, &batch);
+                if (walk == last)
+                    break;
             }
         }
+        else
+            nruns = batch_run(runs, nruns, &batch);
+
+        walk = next;
     }
+
+    if (nruns)
+        write_runs(runs, nruns);
 }
 
 static void __fs_flush(void)
 {
-    CHANGE *this;
+    CHANGE *boot;
+
+    /* boot sector, which has the dirty flag, is written last */
+    flush_area(fat_start, fat_end);
+    flush_area(fat_end, dev_size);
+    flush_area(SECTOR_SIZE, fat_start);
+
+    boot = changes[0];
+    if (boot && boot->pos < SECTOR_SIZE) {
+        /* including ones of the previous flush */
+        fs_barrier();
+        flush_area(0, SECTOR_SIZE);
+    }
+
+    free_change_list();
+}
+
+void fs_print_flush(void)
+{
+    printf("Write back : %lu changes in %lu writes, %llu bytes, "
+            "%llu bytes spilled\n",
+            flush_changes, flush_writes, flush_bytes, spill_bytes);
+}
+
+/* FNV-1a */
+static uint64_t journal_sum(uint64_t sum, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    while (size--) {
+        sum ^= *p++;
+        sum *= 0x100000001b3ULL;
+    }
+
+    return sum;
+}
+
+static void journal_io(int write, void *data, size_t size)
+{
+    size_t did;
+
+    if (write)
+        did = fwrite(data, 1, size, journal);
+    else
+        did = fread(data, 1, size, journal);
+
+    if (did != size) {
+        if (ferror(journal))
+            pdie("%s journal %s", write ? "Write" : "Read", journal_path);
+        die("Journal %s is shorter than expected", journal_path);
+    }
+}
+
+static void journal_seek(long pos)
+{
+    if (fseek(journal, pos, SEEK_SET) < 0)
+        pdie("Seek journal %s", journal_path);
+}
+
+static void journal_sync(void)
+{
+    if (fflush(journal) == EOF || fdatasync(fileno(journal)) < 0)
+        pdie("Sync journal %s", journal_path);
+}
+
+static void journal_commit(void)
+{
+    uint32_t state = JOURNAL_COMMITTED;
+
+    journal_seek(offsetof(JOURNAL_HEAD, state));
+    journal_io(1, &state, sizeof(state));
+    journal_sync();
+
+    fclose(journal);
+    journal = NULL;
+}
+
+/* Save all changes to journal and make it durable */
+static void write_journal(void)
+{
+    JOURNAL_HEAD head;
+    JOURNAL_REC rec;
+    CHANGE *walk;
+    char *buf;
     int size;
+    int i;
+
+    journal = fopen(journal_path, "w+");
+    if (!journal)
+        pdie("Can't create journal %s", journal_path);
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, JOURNAL_MAGIC, sizeof(head.magic));
+    head.version = JOURNAL_VERSION;
+    head.clean = !remain_dirty;
+    head.dev_id = dev_id;
+    head.dev_size = dev_size;
+    for (walk = changes[0]; walk; walk = walk->next[0])
+        head.count++;
+    head.sum = journal_sum(0xcbf29ce484222325ULL, &head, sizeof(head));
+
+    /* header is written again with checksum after records */
+    journal_io(1, &head, sizeof(head));
+
+    buf = alloc_mem(JOURNAL_BUF);
+    for (walk = changes[0]; walk; walk = walk->next[0]) {
+        memset(&rec, 0, sizeof(rec));
+        rec.pos = walk->pos;
+        rec.size = walk->size;
+        head.sum = journal_sum(head.sum, &rec, sizeof(rec));
+        journal_io(1, &rec, sizeof(rec));
+
+        for (i = 0; i < walk->size; i += size) {
+            size = min(walk->size - i, JOURNAL_BUF);
+            get_change_data(walk, walk->pos + i, size, buf);
+            head.sum = journal_sum(head.sum, buf, size);
+            journal_io(1, buf, size);
+        }
+    }
+    free_mem(buf);
 
-    while (changes) {
-        this = changes;
-        changes = changes->next;
-        if ((size = pwrite(fd, this->data, this->size, this->pos)) < 0)
-            fprintf(stderr, "Writing %d bytes at %lld failed: %s\n",
-                    this->size, (long long)this->pos, strerror(errno));
-        else if (size != this->size)
-            fprintf(stderr, "Wrote %d bytes instead of %d bytes at %lld.\n",
-                    size, this->size, (long long)this->pos);
-        free_mem(this->data);
-        free_mem(this);
+    head.state = JOURNAL_PENDING;
+    journal_seek(0);
+    journal_io(1, &head, sizeof(head));
+    journal_sync();
+}
+
+/* Returns 1 if records match checksum in 'head' and are in the device */
+static int check_journal(JOURNAL_HEAD *head, char *buf)
+{
+    JOURNAL_HEAD copy = *head;
+    JOURNAL_REC rec;
+    uint64_t sum;
+    uint32_t i;
+    int size;
+    int done;
+
+    copy.state = 0;
+    copy.sum = 0;
+    sum = journal_sum(0xcbf29ce484222325ULL, &copy, sizeof(copy));
+
+    for (i = 0; i < head->count; i++) {
+        if (fread(&rec, sizeof(rec), 1, journal) != 1 ||
+                rec.pos + rec.size > head->dev_size)
+            return 0;
+        sum = journal_sum(sum, &rec, sizeof(rec));
+
+        for (done = 0; done < rec.size; done += size) {
+            size = min(rec.size - done, JOURNAL_BUF);
+            if (fread(buf, size, 1, journal) != 1)
+                return 0;
+            sum = journal_sum(sum, buf, size);
+        }
     }
+
+    return sum == head->sum;
 }
 
-#ifdef CONFIG_SYNC_FILE_RANGE
-#define CHUNK_SIZE	(512 * 1024 * 1024)
-/* NOTE: Using sync_file_range() function does not portable */
-void fs_sync(void)
+int fs_replay_journal(void)
 {
-    off_t offset = 0;
-    size_t chunk_size = CHUNK_SIZE;
-    size_t bytes_to_sync = 0;
+    JOURNAL_HEAD head;
+    JOURNAL_REC rec;
+    char *buf;
+    uint32_t i;
+    int size;
+    int done;
 
-    /* Request writeback */
-	while (offset < dev_size) {
-		bytes_to_sync = (dev_size - offset) < chunk_size ?
-			(dev_size - offset) : chunk_size;
+    if (!journal_path)
+        return -1;
 
-		if (sync_file_range(fd, offset, bytes_to_sync,
-					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE) == -1)
-			pdie("sync_file_range(): SYNC_FILE_RANGE_WAIT_AFTER");
+    journal = fopen(journal_path, "r+");
+    if (!journal) {
+        if (errno != ENOENT)
+            pdie("Can't open journal %s", journal_path);
+        return -1;
+    }
+
+    if (fread(&head, sizeof(head), 1, journal) != 1 ||
+            memcmp(head.magic, JOURNAL_MAGIC, sizeof(head.magic)) ||
+            head.version != JOURNAL_VERSION ||
+            head.state != JOURNAL_PENDING) {
+        /* committed, or not written completely */
+        fclose(journal);
+        journal = NULL;
+        return -1;
+    }
 
-		offset += bytes_to_sync;
-	}
+    if (head.dev_id != dev_id || head.dev_size != dev_size) {
+        printf("Journal %s is not of this device, ignored.\n", journal_path);
+        fclose(journal);
+        journal = NULL;
+        return -1;
+    }
+
+    buf = alloc_mem(JOURNAL_BUF);
+    if (!check_journal(&head, buf)) {
+        /* device is not written before journal is complete */
+        printf("Journal %s is incomplete, ignored.\n", journal_path);
+        free_mem(buf);
+        fclose(journal);
+        journal = NULL;
+        return -1;
+    }
 
-	/* Wait for IO completion */
-	bytes_to_sync = 0;
-	offset = 0;
-	while (offset < dev_size) {
-		bytes_to_sync = (dev_size - offset) < chunk_size ?
-			(dev_size - offset) : chunk_size;
+    journal_seek(sizeof(head));
+    for (i = 0; i < head.count; i++) {
+        journal_io(0, &rec, sizeof(rec));
+        for (done = 0; done < rec.size; done += size) {
+            size = min(rec.size - done, JOURNAL_BUF);
+            journal_io(0, buf, size);
+            fs_write_immed(rec.pos + done, size, buf);
+        }
+    }
+    free_mem(buf);
 
-		if (sync_file_range(fd, offset, bytes_to_sync,
-					SYNC_FILE_RANGE_WAIT_AFTER) == -1)
-			pdie("sync_file_range(): SYNC_FILE_RANGE_WAIT_AFTER");
+    fs_barrier();
+    journal_commit();
+    printf("Replayed %u changes of journal %s.\n", head.count, journal_path);
 
-		offset += bytes_to_sync;
-	}
+    return head.clean;
 }
-#endif
 
 int fs_flush(int write)
 {
-    CHANGE *next;
     int changed;
 
-    changed = !!changes;
-    if (write)
+    changed = !!changes[0];
+    if (write) {
+        /* journal kept after failed writes should not be overwritten */
+        if (journal_path && changes[0] && !write_failed)
+            write_journal();
         __fs_flush();
+    }
     else {
         /* do not write and free changes */
-        while (changes) {
-            next = changes->next;
-            free_mem(changes->data);
-            free_mem(changes);
-            changes = next;
-        }
+        free_change_list();
     }
-#ifdef CONFIG_SYNC_FILE_RANGE
-    fs_sync();
-#else
-    fsync(fd);
-#endif
+    sync_dirty();
+
+    if (journal && write_failed) {
+        printf("Journal %s is kept to be replayed.\n", journal_path);
+        fclose(journal);
+        journal = NULL;
+    }
+    else if (journal) {
+        /* data should be durable before journal is committed */
+        fs_barrier();
+        journal_commit();
+    }
+
     return changed || did_change;
 }
 
 void fs_close(void)
 {
-    if (close(fd) < 0)
+    fs_barrier();
+    free_cache();
+
+    if (scratch_fd >= 0) {
+        close(scratch_fd);
+        scratch_fd = -1;
+    }
+
+    if (io_close(dev) < 0)
         pdie("closing file system");
 }
 
 int fs_changed(void)
 {
-    return !!changes || did_change;
+    return !!changes[0] || did_change;
 }
 
 void *fs_mmap(void *addr, off_t offset, size_t length)
 {
-    void *ret_addr = NULL;
+    void *ret_addr;
 
     /*
      * When mmap() is called with the MAP_POPULATE flag
@@ -472,8 +1574,8 @@ void *fs_mmap(void *addr, off_t offset, size_t length)
      * Therefore, remove the MAP_POPULATE flag and handle the SIGBUS signal
      * that occurs when accessing memory mapped address afterwards.
      */
-    ret_addr = mmap(addr, length, PROT_READ, MAP_SHARED, fd, offset);
-    if (ret_addr == NULL || ret_addr == MAP_FAILED)
+    ret_addr = io_mmap(dev, addr, length, offset);
+    if (ret_addr == NULL)
         pdie("mmap %ld offset failed", offset);
 
     return ret_addr;
@@ -483,7 +1585,7 @@ int fs_munmap(void *addr, size_t length)
 {
     int ret;
 
-    ret = munmap(addr, length);
+    ret = io_munmap(dev, addr, length);
     if (ret < 0)
         pdie("munmap (%p:%ld) failed", addr, length);
 
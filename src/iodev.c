@@ -0,0 +1,571 @@
+/* SPDX-FileCopyrightText : (c) 2026 LG Electronics Inc. */
+/* SPDX-License-Identifier : GPL-2.0 */
+
+/* iodev.c  -  I/O backends of device */
+
+#define _GNU_SOURCE     /* for sync_file_range() */
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "iodev.h"
+
+static const IO_OPS *backends[] = {
+    &fd_ops,
+    &mem_ops,
+    &uring_ops,
+    &fault_ops,
+};
+
+const IO_OPS *io_find_backend(const char *name)
+{
+    size_t len = strcspn(name, ":");
+    int i;
+
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strlen(backends[i]->name) == len &&
+                !strncmp(backends[i]->name, name, len))
+            return backends[i];
+    }
+
+    return NULL;
+}
+
+IO_DEV *io_open(const char *name, const char *path, int flags)
+{
+    const IO_OPS *ops;
+    const char *opts;
+    IO_DEV *dev;
+
+    ops = io_find_backend(name);
+    if (!ops)
+        die("Unknown I/O backend %s", name);
+
+    dev = alloc_mem(sizeof(IO_DEV));
+    dev->ops = ops;
+    dev->fd = -1;
+
+    opts = strchr(name, ':');
+    if (opts) {
+        dev->opts = alloc_mem(strlen(opts));
+        strcpy(dev->opts, opts + 1);
+    }
+
+    if (ops->open(dev, path, flags) < 0)
+        pdie("open %s", path);
+
+    return dev;
+}
+
+int io_close(IO_DEV *dev)
+{
+    int ret;
+
+    ret = dev->ops->close(dev);
+    free_mem(dev->opts);
+    free_mem(dev);
+
+    return ret;
+}
+
+int io_submit(IO_DEV *dev, IO_REQ *reqs, int cnt)
+{
+    IO_REQ *req;
+    ssize_t res;
+
+    if (dev->ops->submit)
+        return dev->ops->submit(dev, reqs, cnt);
+
+    for (req = reqs; req < reqs + cnt; req++) {
+        if (req->write)
+            res = io_pwritev(dev, req->iov, req->cnt, req->pos);
+        else
+            res = io_preadv(dev, req->iov, req->cnt, req->pos);
+        req->res = res < 0 ? -errno : res;
+    }
+
+    return 0;
+}
+
+/*
+ * fd backend: system calls on the device
+ */
+static int fd_open(IO_DEV *dev, const char *path, int flags)
+{
+    dev->fd = open(path, flags);
+
+    return dev->fd < 0 ? -1 : 0;
+}
+
+static int fd_close(IO_DEV *dev)
+{
+    return close(dev->fd);
+}
+
+static ssize_t fd_pread(IO_DEV *dev, void *data, size_t size, loff_t pos)
+{
+    return pread(dev->fd, data, size, pos);
+}
+
+static ssize_t fd_preadv(IO_DEV *dev, const struct iovec *iov, int cnt,
+        loff_t pos)
+{
+    return preadv(dev->fd, iov, cnt, pos);
+}
+
+static ssize_t fd_pwrite(IO_DEV *dev, const void *data, size_t size,
+        loff_t pos)
+{
+    return pwrite(dev->fd, data, size, pos);
+}
+
+static ssize_t fd_pwritev(IO_DEV *dev, const struct iovec *iov, int cnt,
+        loff_t pos)
+{
+    return pwritev(dev->fd, iov, cnt, pos);
+}
+
+static void *fd_mmap(IO_DEV *dev, void *addr, size_t length, loff_t pos)
+{
+    void *ret_addr;
+
+    ret_addr = mmap(addr, length, PROT_READ, MAP_SHARED, dev->fd, pos);
+
+    return ret_addr == MAP_FAILED ? NULL : ret_addr;
+}
+
+static int fd_munmap(IO_DEV *dev, void *addr, size_t length)
+{
+    return munmap(addr, length);
+}
+
+#ifdef CONFIG_SYNC_FILE_RANGE
+/* NOTE: Using sync_file_range() function does not portable */
+static int fd_sync(IO_DEV *dev, loff_t pos, loff_t length)
+{
+    return sync_file_range(dev->fd, pos, length,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+            SYNC_FILE_RANGE_WAIT_AFTER);
+}
+#else
+static int fd_sync(IO_DEV *dev, loff_t pos, loff_t length)
+{
+    return fdatasync(dev->fd);
+}
+#endif
+
+static int fd_barrier(IO_DEV *dev)
+{
+    return fdatasync(dev->fd);
+}
+
+static loff_t fd_size(IO_DEV *dev)
+{
+    return lseek(dev->fd, 0, SEEK_END);
+}
+
+const IO_OPS fd_ops = {
+    .name = "fd",
+    .open = fd_open,
+    .close = fd_close,
+    .pread = fd_pread,
+    .preadv = fd_preadv,
+    .pwrite = fd_pwrite,
+    .pwritev = fd_pwritev,
+    .mmap = fd_mmap,
+    .munmap = fd_munmap,
+    .sync = fd_sync,
+    .barrier = fd_barrier,
+    .size = fd_size,
+};
+
+/*
+ * mem backend: whole image is read into memory at open. Writes go to the
+ * memory and the written range is copied back to the device by sync.
+ */
+typedef struct mem_dev {
+    char *image;
+    loff_t size;
+    loff_t dirty_start;     /* written range since last sync */
+    loff_t dirty_end;
+    int rw;
+} MEM_DEV;
+
+static int mem_open(IO_DEV *dev, const char *path, int flags)
+{
+    MEM_DEV *mem;
+    loff_t pos;
+    ssize_t got;
+
+    if (fd_open(dev, path, flags) < 0)
+        return -1;
+
+    mem = alloc_mem(sizeof(MEM_DEV));
+    dev->priv = mem;
+    mem->rw = (flags & O_ACCMODE) != O_RDONLY;
+    mem->size = fd_size(dev);
+    if (mem->size <= 0) {
+        errno = mem->size ? errno : EINVAL;
+        return -1;
+    }
+
+    /* image may be bigger than alloc_mem() can handle */
+    mem->image = mmap(NULL, mem->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem->image == MAP_FAILED)
+        return -1;
+
+    for (pos = 0; pos < mem->size; pos += got) {
+        got = pread(dev->fd, mem->image + pos, mem->size - pos, pos);
+        if (got <= 0) {
+            errno = got ? errno : EIO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int mem_close(IO_DEV *dev)
+{
+    MEM_DEV *mem = dev->priv;
+
+    munmap(mem->image, mem->size);
+    free_mem(mem);
+
+    return fd_close(dev);
+}
+
+/* Returns bytes from 'pos' up to 'size' within image */
+static size_t mem_span(MEM_DEV *mem, size_t size, loff_t pos)
+{
+    if (pos < 0 || pos >= mem->size)
+        return 0;
+
+    return mem->size - pos < size ? mem->size - pos : size;
+}
+
+static ssize_t mem_pread(IO_DEV *dev, void *data, size_t size, loff_t pos)
+{
+    MEM_DEV *mem = dev->priv;
+
+    size = mem_span(mem, size, pos);
+    memcpy(data, mem->image + pos, size);
+
+    return size;
+}
+
+static ssize_t mem_preadv(IO_DEV *dev, const struct iovec *iov, int cnt,
+        loff_t pos)
+{
+    ssize_t total = 0;
+    size_t got;
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+        got = mem_pread(dev, iov[i].iov_base, iov[i].iov_len, pos + total);
+        total += got;
+        if (got < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+static void mem_dirty(MEM_DEV *mem, loff_t pos, size_t size)
+{
+    if (mem->dirty_start == mem->dirty_end) {
+        mem->dirty_start = pos;
+        mem->dirty_end = pos + size;
+        return;
+    }
+
+    if (pos < mem->dirty_start)
+        mem->dirty_start = pos;
+    if (pos + size > mem->dirty_end)
+        mem->dirty_end = pos + size;
+}
+
+static ssize_t mem_pwrite(IO_DEV *dev, const void *data, size_t size,
+        loff_t pos)
+{
+    MEM_DEV *mem = dev->priv;
+
+    if (!mem->rw) {
+        errno = EBADF;
+        return -1;
+    }
+
+    size = mem_span(mem, size, pos);
+    if (!size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    memcpy(mem->image + pos, data, size);
+    mem_dirty(mem, pos, size);
+
+    return size;
+}
+
+static ssize_t mem_pwritev(IO_DEV *dev, const struct iovec *iov, int cnt,
+        loff_t pos)
+{
+    ssize_t total = 0;
+    ssize_t did;
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+        did = mem_pwrite(dev, iov[i].iov_base, iov[i].iov_len, pos + total);
+        if (did < 0)
+            return total ? total : -1;
+
+        total += did;
+        if (did < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+static void *mem_mmap(IO_DEV *dev, void *addr, size_t length, loff_t pos)
+{
+    MEM_DEV *mem = dev->priv;
+
+    if (mem_span(mem, length, pos) != length) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return mem->image + pos;
+}
+
+static int mem_munmap(IO_DEV *dev, void *addr, size_t length)
+{
+    return 0;
+}
+
+/* Write whole dirty range back */
+static int mem_sync(IO_DEV *dev, loff_t pos, loff_t length)
+{
+    MEM_DEV *mem = dev->priv;
+    loff_t start;
+    ssize_t did;
+
+    for (start = mem->dirty_start; start < mem->dirty_end; start += did) {
+        did = pwrite(dev->fd, mem->image + start, mem->dirty_end - start,
+                start);
+        if (did <= 0) {
+            errno = did ? errno : EIO;
+            return -1;
+        }
+    }
+    mem->dirty_start = mem->dirty_end = 0;
+
+    return 0;
+}
+
+static int mem_barrier(IO_DEV *dev)
+{
+    MEM_DEV *mem = dev->priv;
+
+    if (mem_sync(dev, 0, mem->size) < 0)
+        return -1;
+
+    return mem->rw ? fdatasync(dev->fd) : 0;
+}
+
+static loff_t mem_size(IO_DEV *dev)
+{
+    MEM_DEV *mem = dev->priv;
+
+    return mem->size;
+}
+
+const IO_OPS mem_ops = {
+    .name = "mem",
+    .open = mem_open,
+    .close = mem_close,
+    .pread = mem_pread,
+    .preadv = mem_preadv,
+    .pwrite = mem_pwrite,
+    .pwritev = mem_pwritev,
+    .mmap = mem_mmap,
+    .munmap = mem_munmap,
+    .sync = mem_sync,
+    .barrier = mem_barrier,
+    .size = mem_size,
+};
+
+/*
+ * fault backend: fd backend failing with EIO as told by options
+ *   read=N         N-th and later reads fail
+ *   write=N        N-th and later writes fail, e.g. device is gone
+ *   bad=POS+LEN    reads overlapping the range fail (K, M, G suffix)
+ * Mapped area is not affected.
+ */
+typedef struct fault_dev {
+    unsigned long reads;        /* counted atomically, threads read FAT */
+    unsigned long writes;
+    unsigned long read_fail;    /* 0 if reads never fail */
+    unsigned long write_fail;
+    loff_t bad_start;
+    loff_t bad_end;
+} FAULT_DEV;
+
+static unsigned long parse_count(char *str)
+{
+    unsigned long val;
+    char *end;
+
+    val = strtoul(str, &end, 0);
+    if (end == str || *end)
+        die("Bad option of fault backend: %s", str);
+
+    return val;
+}
+
+static void parse_fault_opts(FAULT_DEV *fault, char *opts)
+{
+    char *opt, *val, *len;
+    long long start, size;
+
+    for (opt = strtok(opts, ","); opt; opt = strtok(NULL, ",")) {
+        val = strchr(opt, '=');
+        if (!val)
+            die("Bad option of fault backend: %s", opt);
+        *val++ = 0;
+
+        if (!strcmp(opt, "read")) {
+            fault->read_fail = parse_count(val);
+        }
+        else if (!strcmp(opt, "write")) {
+            fault->write_fail = parse_count(val);
+        }
+        else if (!strcmp(opt, "bad")) {
+            len = strchr(val, '+');
+            if (len)
+                *len++ = 0;
+
+            start = parse_size(val);
+            size = len ? parse_size(len) : 1;
+            if (start < 0 || size < 0)
+                die("Bad range of fault backend: %s", val);
+
+            fault->bad_start = start;
+            fault->bad_end = start + size;
+        }
+        else {
+            die("Unknown option of fault backend: %s", opt);
+        }
+    }
+}
+
+static int fault_open(IO_DEV *dev, const char *path, int flags)
+{
+    FAULT_DEV *fault;
+
+    fault = alloc_mem(sizeof(FAULT_DEV));
+    dev->priv = fault;
+    if (dev->opts)
+        parse_fault_opts(fault, dev->opts);
+
+    return fd_open(dev, path, flags);
+}
+
+static int fault_close(IO_DEV *dev)
+{
+    free_mem(dev->priv);
+
+    return fd_close(dev);
+}
+
+static int fault_read(FAULT_DEV *fault, size_t size, loff_t pos)
+{
+    unsigned long reads = __sync_add_and_fetch(&fault->reads, 1);
+
+    if (fault->read_fail && reads >= fault->read_fail)
+        return 1;
+
+    return pos < fault->bad_end && pos + (loff_t)size > fault->bad_start;
+}
+
+static ssize_t fault_pread(IO_DEV *dev, void *data, size_t size, loff_t pos)
+{
+    if (fault_read(dev->priv, size, pos)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return fd_pread(dev, data, size, pos);
+}
+
+static ssize_t fault_preadv(IO_DEV *dev, const struct iovec *iov, int cnt,
+        loff_t pos)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < cnt; i++)
+        size += iov[i].iov_len;
+
+    if (fault_read(dev->priv, size, pos)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return fd_preadv(dev, iov, cnt, pos);
+}
+
+static int fault_write(FAULT_DEV *fault)
+{
+    unsigned long writes = __sync_add_and_fetch(&fault->writes, 1);
+
+    return fault->write_fail && writes >= fault->write_fail;
+}
+
+static ssize_t fault_pwrite(IO_DEV *dev, const void *data, size_t size,
+        loff_t pos)
+{
+    if (fault_write(dev->priv)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return fd_pwrite(dev, data, size, pos);
+}
+
+static ssize_t fault_pwritev(IO_DEV *dev, const struct iovec *iov, int cnt,
+        loff_t pos)
+{
+    if (fault_write(dev->priv)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return fd_pwritev(dev, iov, cnt, pos);
+}
+
+const IO_OPS fault_ops = {
+    .name = "fault",
+    .open = fault_open,
+    .close = fault_close,
+    .pread = fault_pread,
+    .preadv = fault_preadv,
+    .pwrite = fault_pwrite,
+    .pwritev = fault_pwritev,
+    .mmap = fd_mmap,
+    .munmap = fd_munmap,
+    .sync = fd_sync,
+    .barrier = fd_barrier,
+    .size = fd_size,
+};
@@ -0,0 +1,367 @@
+/* SPDX-FileCopyrightText : (c) 2026 LG Electronics Inc. */
+/* SPDX-License-Identifier : GPL-2.0 */
+
+/* uring.c  -  io_uring I/O backend */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "common.h"
+#include "iodev.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#define URING_ENTRIES   64  /* max requests in flight */
+
+/* io_uring without liburing, rings are mapped as the kernel gives them */
+typedef struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;   /* threads reading FAT share the ring */
+#endif
+} URING;
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+        unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+            NULL, 0);
+}
+
+static void unmap_rings(URING *ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+            ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+static int setup_ring(URING *ring)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = io_uring_setup(URING_ENTRIES, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->entries = p.sq_entries;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+        goto fail;
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+    cq = ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+
+fail:
+    unmap_rings(ring);
+    close(ring->fd);
+    return -1;
+}
+
+/* Completion of 'req' is tagged with its address, which is unique among
+   requests in flight */
+static void queue_req(IO_DEV *dev, IO_REQ *req)
+{
+    URING *ring = dev->priv;
+    struct io_uring_sqe *sqe;
+    unsigned int tail;
+
+    tail = *ring->sq_tail;
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = dev->fd;
+    sqe->addr = (unsigned long)req->iov;
+    sqe->len = req->cnt;
+    sqe->off = req->pos;
+    sqe->user_data = (unsigned long)req;
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+
+    /* kernel must see the entry before the new tail */
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the number of completed requests reaped, which are all of the
+   caller as the ring is locked */
+static int reap_reqs(URING *ring)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    int cnt = 0;
+
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        ((IO_REQ *)(unsigned long)cqe->user_data)->res = cqe->res;
+        head++;
+        cnt++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return cnt;
+}
+
+/* Keep up to 'entries' requests in flight, wait for one at least whenever
+   the queue is full or all are queued. Called with the ring locked. */
+static int submit_reqs(IO_DEV *dev, IO_REQ *reqs, int cnt)
+{
+    URING *ring = dev->priv;
+    int queued = 0;
+    int pending = 0;    /* queued but not submitted */
+    int done = 0;
+    int ret;
+
+    while (done < cnt) {
+        while (queued < cnt && queued - done < ring->entries) {
+            queue_req(dev, &reqs[queued]);
+            queued++;
+            pending++;
+        }
+
+        ret = io_uring_enter(ring->fd, pending, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            /* take back the ones kernel has not seen yet */
+            __atomic_store_n(ring->sq_tail, *ring->sq_tail - pending,
+                    __ATOMIC_RELEASE);
+            if (queued - pending > done)
+                pdie("io_uring_enter with requests in flight");
+            return -1;
+        }
+        if (ret > 0)
+            pending -= ret;
+
+        done += reap_reqs(ring);
+    }
+
+    return 0;
+}
+
+/* Only one thread queues and reaps requests at a time */
+static int uring_submit(IO_DEV *dev, IO_REQ *reqs, int cnt)
+{
+#ifdef HAVE_PTHREAD
+    URING *ring = dev->priv;
+    int ret;
+
+    pthread_mutex_lock(&ring->lock);
+    ret = submit_reqs(dev, reqs, cnt);
+    pthread_mutex_unlock(&ring->lock);
+
+    return ret;
+#else
+    return submit_reqs(dev, reqs, cnt);
+#endif
+}
+
+/* Run one vectored request, same as system call */
+static ssize_t uring_rw(IO_DEV *dev, int write, const struct iovec *iov,
+        int cnt, loff_t pos)
+{
+    IO_REQ req = { write, iov, cnt, pos, 0 };
+
+    if (uring_submit(dev, &req, 1) < 0)
+        return -1;
+
+    if (req.res < 0) {
+        errno = -req.res;
+        return -1;
+    }
+
+    return req.res;
+}
+
+static int uring_open(IO_DEV *dev, const char *path, int flags)
+{
+    URING *ring;
+
+    if (fd_ops.open(dev, path, flags) < 0)
+        return -1;
+
+    /* e.g. old kernel or io_uring disabled */
+    ring = alloc_mem(sizeof(URING));
+    if (setup_ring(ring) < 0) {
+        free_mem(ring);
+        dev->ops = &fd_ops;
+        return 0;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&ring->lock, NULL);
+#endif
+    dev->priv = ring;
+
+    return 0;
+}
+
+static int uring_close(IO_DEV *dev)
+{
+    URING *ring = dev->priv;
+
+    unmap_rings(ring);
+    close(ring->fd);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&ring->lock);
+#endif
+    free_mem(ring);
+
+    return fd_ops.close(dev);
+}
+
+static ssize_t uring_pread(IO_DEV *dev, void *data, size_t size, loff_t pos)
+{
+    struct iovec iov = { data, size };
+
+    return uring_rw(dev, 0, &iov, 1, pos);
+}
+
+static ssize_t uring_preadv(IO_DEV *dev, const struct iovec *iov, int cnt,
+        loff_t pos)
+{
+    return uring_rw(dev, 0, iov, cnt, pos);
+}
+
+static ssize_t uring_pwrite(IO_DEV *dev, const void *data, size_t size,
+        loff_t pos)
+{
+    struct iovec iov = { (void *)data, size };
+
+    return uring_rw(dev, 1, &iov, 1, pos);
+}
+
+static ssize_t uring_pwritev(IO_DEV *dev, const struct iovec *iov, int cnt,
+        loff_t pos)
+{
+    return uring_rw(dev, 1, iov, cnt, pos);
+}
+
+/* others are same as fd backend */
+static void *uring_mmap(IO_DEV *dev, void *addr, size_t length, loff_t pos)
+{
+    return fd_ops.mmap(dev, addr, length, pos);
+}
+
+static int uring_munmap(IO_DEV *dev, void *addr, size_t length)
+{
+    return fd_ops.munmap(dev, addr, length);
+}
+
+static int uring_sync(IO_DEV *dev, loff_t pos, loff_t length)
+{
+    return fd_ops.sync(dev, pos, length);
+}
+
+static int uring_barrier(IO_DEV *dev)
+{
+    return fd_ops.barrier(dev);
+}
+
+static loff_t uring_size(IO_DEV *dev)
+{
+    return fd_ops.size(dev);
+}
+
+const IO_OPS uring_ops = {
+    .name = "uring",
+    .open = uring_open,
+    .close = uring_close,
+    .pread = uring_pread,
+    .preadv = uring_preadv,
+    .pwrite = uring_pwrite,
+    .pwritev = uring_pwritev,
+    .submit = uring_submit,
+    .mmap = uring_mmap,
+    .munmap = uring_munmap,
+    .sync = uring_sync,
+    .barrier = uring_barrier,
+    .size = uring_size,
+};
+
+#else
+
+/* io_uring can't be used without its header */
+static int uring_open(IO_DEV *dev, const char *path, int flags)
+{
+    dev->ops = &fd_ops;
+
+    return fd_ops.open(dev, path, flags);
+}
+
+const IO_OPS uring_ops = {
+    .name = "uring",
+    .open = uring_open,
+};
+
+#endif